@@ -1,22 +1,66 @@
 /* Copyright (c) 2023 Thierry FOURNIER (tfournier@arpalert.org) */
 
+#define _GNU_SOURCE /* sched_getcpu() */
+
 #include <sys/mman.h>
+#include <sys/syscall.h>
 
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AC_HAVE_TEDDY
+#endif
 
 #include "aho-corasick.h"
 
 /* useful only with mmap mapping */
 #define MAP_BLOC_SZ (1024*1024)
 
+/* NUMA memory policy of mbind(), see <numaif.h> */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* max number of NUMA nodes, one bit per node in the mbind() mask */
+#define AC_MAX_NUMA_NODES ((int)sizeof(unsigned long) * 8)
+
 #define NODESLOTS(__n) ((__n)->first > (__n)->last ? 0 : (__n)->last - (__n)->first + 1)
-#define NODESZ(__n) (sizeof(struct ac_node) + (NODESLOTS(__n) * sizeof(struct ac_node *)))
+#define NODEIDSZ(__n) ((__n)->match > 0 ? sizeof(unsigned int) : 0)
+#define NODESZ(__n) (sizeof(struct ac_node) + (NODESLOTS(__n) * sizeof(struct ac_node *)) + NODEIDSZ(__n))
+#define NODEIDPTR(__n) ((char *)(__n)->children + (NODESLOTS(__n) * sizeof(struct ac_node *)))
 #define NODENEXT(__n) ((struct ac_node *)((char *)(__n) + NODESZ(__n)))
 #define NODEEND(__r) ((struct ac_node *)((__r)->data + (__r)->length))
 #define NODEADDOFFSET(__n, __o) ((struct ac_node *)((char *)(__n) + (__o)))
 #define NODESUBOFFSET(__n, __o) ((struct ac_node *)((char *)(__n) - (__o)))
 
+/* Return the match identifier stored after the children, 0 if the node
+ * doesn't match. The identifier is not aligned.
+ */
+static inline
+unsigned int node_get_id(const struct ac_node *node)
+{
+	unsigned int id;
+
+	if (node->match <= 0)
+		return 0;
+	memcpy(&id, NODEIDPTR(node), sizeof(id));
+	return id;
+}
+
+static inline
+void node_set_id(struct ac_node *node, unsigned int id)
+{
+	memcpy(NODEIDPTR(node), &id, sizeof(id));
+}
+
 static inline
 void *ac_realloc(struct ac_root *root, size_t size) {
 	size_t new_size;
@@ -100,31 +144,20 @@ void node_move(char *new_bloc, struct ac_root *root,
 
 
 
-/* This function growth a node, but it can change all pointers.
+/* This function growth a node of <sz> bytes, or allocates a new node
+ * if <node> is NULL, but it can change all pointers.
  * changing memory locations. The growth pointer is returned.
  * the incoming pointer must not be used after calling this
  * function. Note the "track" variable accept a pointer and
  * the function apply shit on this pointer ios needed.
  */
 static inline
-struct ac_node *node_growth(struct ac_root *root, struct ac_node *node, int slots, struct ac_node **track)
+struct ac_node *node_growth(struct ac_root *root, struct ac_node *node, size_t sz, struct ac_node **track)
 {
 	struct ac_node *n;
-	size_t cur_slots;
-	size_t sz;
 	char *new_bloc;
 	int i;
 
-	/* Compute the size to add to main memory bloc */
-	if (node == NULL) {
-		sz = sizeof(struct ac_node) + (slots * sizeof(struct ac_node *));
-	} else if (node->first > node->last) {
-		sz = slots * sizeof(struct ac_node *);
-	} else {
-		cur_slots = node->last - node->first + 1;
-		sz = (slots - cur_slots) * sizeof(struct ac_node *);
-	}
-
 	/* execute effective realloc and update bloc length */
 	new_bloc = ac_realloc(root, root->length + sz);
 	if (new_bloc == NULL)
@@ -168,12 +201,16 @@ struct ac_node *node_growth(struct ac_root *root, struct ac_node *node, int slot
 	return node;
 }
 
+/* Return the size to add to <node> for <slots> children */
+#define NODEGROWTH(__n, __s) (((__s) - NODESLOTS(__n)) * sizeof(struct ac_node *))
+
 /* compressed index add children */
 static inline
 struct ac_node *node_add_children(struct ac_root *root, struct ac_node *node, unsigned char c)
 {
 	unsigned char index;
 	struct ac_node *new;
+	unsigned int id;
 
 	/* This function perform two allocation, the first one is new node without
 	 * childrens and the second is a growth of existing children. Each one of
@@ -183,14 +220,19 @@ struct ac_node *node_add_children(struct ac_root *root, struct ac_node *node, un
 	 * receive its value remains uninitialized, and the next growth operation
 	 * could read uninitialized pointer (in reallity we dont care).
 	 */
-	new = node_growth(root, NULL, 0, &node);
+	new = node_growth(root, NULL, sizeof(struct ac_node), &node);
 	if (new == NULL)
 		return NULL;
 	new->first = 1;
 
+	/* The match identifier follows the children, it is moved after
+	 * the growth array.
+	 */
+	id = node_get_id(node);
+
 	/* first case : array not initialized */
 	if (node->last < node->first) {
-		node = node_growth(root, node, 1, &new);
+		node = node_growth(root, node, NODEGROWTH(node, 1), &new);
 		if (node == NULL)
 			return NULL;
 		node->first = c;
@@ -205,7 +247,7 @@ struct ac_node *node_add_children(struct ac_root *root, struct ac_node *node, un
 
 	/* third case : new node is lower than low boundary */
 	else if (c < node->first) {
-		node = node_growth(root, node, node->last - c + 1, &new);
+		node = node_growth(root, node, NODEGROWTH(node, node->last - c + 1), &new);
 		if (node == NULL)
 			return NULL;
 		/* move memory from 0 to new destination */
@@ -220,7 +262,7 @@ struct ac_node *node_add_children(struct ac_root *root, struct ac_node *node, un
 
 	/* third case : new node is upper than high boundary */
 	else {
-		node = node_growth(root, node, c - node->first + 1, &new);
+		node = node_growth(root, node, NODEGROWTH(node, c - node->first + 1), &new);
 		if (node == NULL)
 			return NULL;
 		/* reset from last slot + 1 for number of new slots */
@@ -229,6 +271,9 @@ struct ac_node *node_add_children(struct ac_root *root, struct ac_node *node, un
 		index = c - node->first;
 	}
 
+	if (node->match > 0)
+		node_set_id(node, id);
+
 	/* Index new node */
 	node->children[index] = new;
 	return new;
@@ -288,9 +333,24 @@ struct ac_node *node_browse_first(struct ac_node_browse *bn, struct ac_node *nod
 	return node_browse_next(bn);
 }
 
+/* ASCII case folding used by AC_FOLD trees */
+static inline
+unsigned char ac_fold(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	return c;
+}
+
 /* Init root node */
-int ac_init_root(struct ac_root *root)
+int ac_init_root_flags(struct ac_root *root, int flags)
 {
+	root->flags = flags;
+	root->nb_match = 0;
+	root->longest = 0;
+	root->matches = NULL;
+	root->matches_size = 0;
+	root->teddy = NULL;
 	root->total = 0;
 	root->data = NULL;
 	root->data = ac_realloc(root, sizeof(struct ac_node));
@@ -303,159 +363,952 @@ int ac_init_root(struct ac_root *root)
 	return 1;
 }
 
-/* Insert word in a tree */
-int ac_insert_wordl(struct ac_root *root, char *word, size_t len)
+/* Register groups and case sensitivity of a word ending on the match
+ * <id>. Case sensitive words of folded trees are copied because they
+ * are verified against the original text during the search.
+ */
+static
+int ac_match_add(struct ac_root *root, unsigned int id, char *word, size_t len,
+                 int flags, unsigned int groups)
+{
+	struct ac_match *m;
+	struct ac_word *w;
+	unsigned int size;
+
+	/* Growth the descriptor array for new identifier */
+	if (id > root->matches_size) {
+		size = root->matches_size == 0 ? 64 : root->matches_size * 2;
+		m = realloc(root->matches, size * sizeof(struct ac_match));
+		if (m == NULL)
+			return -1;
+		root->matches = m;
+		root->matches_size = size;
+	}
+	if (id > root->nb_match)
+		memset(&root->matches[id - 1], 0, sizeof(struct ac_match));
+	m = &root->matches[id - 1];
+
+	if (!(root->flags & AC_FOLD) || (flags & AC_NOCASE)) {
+		m->groups |= groups;
+		return 0;
+	}
+
+	/* Do not store twice the same word */
+	for (w = m->words; w != NULL; w = w->next) {
+		if (memcmp(w->word, word, len) == 0) {
+			w->groups |= groups;
+			return 0;
+		}
+	}
+
+	w = malloc(sizeof(struct ac_word) + len);
+	if (w == NULL)
+		return -1;
+	w->groups = groups;
+	w->length = len;
+	memcpy(w->word, word, len);
+	w->next = m->words;
+	m->words = w;
+	return 0;
+}
+
+/* Insert word in a tree with its groups */
+static
+int ac_insert(struct ac_root *root, char *word, size_t len, int flags, unsigned int groups)
 {
 	struct ac_node *node;
+	unsigned char c;
+	unsigned int id;
 	int i;
 
+	/* Case insensitive word requires folded tree */
+	if ((flags & AC_NOCASE) && !(root->flags & AC_FOLD))
+		return -1;
+
+	/* The length is stored in the short match field, empty word
+	 * never matches.
+	 */
+	if (len > SHRT_MAX)
+		return -1;
+	if (len == 0)
+		return 0;
+
 	/* Index wod */
 	node = root->root;
 	for (i = 0; i < len; i++) {
-		node = node_get_or_new_children(root, node, (unsigned char)word[i]);
+		if (root->flags & AC_REVERSE)
+			c = (unsigned char)word[len - 1 - i];
+		else
+			c = (unsigned char)word[i];
+		if (root->flags & AC_FOLD)
+			c = ac_fold(c);
+		node = node_get_or_new_children(root, node, c);
 		if (node == NULL)
 			return -1;
 	}
 
-	/* Mark match */
+	/* Get match identifier */
+	id = node_get_id(node);
+	if (id == 0)
+		id = root->nb_match + 1;
+
+	/* Register groups and case sensitivity */
+	if (root->flags & (AC_FOLD | AC_GROUPS)) {
+		if (ac_match_add(root, id, word, len, flags, groups) != 0)
+			return -1;
+	}
+
+	/* Mark match, the first time the node is growth to store the
+	 * identifier after the children.
+	 */
+	if (node->match == 0) {
+		node = node_growth(root, node, sizeof(unsigned int), NULL);
+		if (node == NULL)
+			return -1;
+	}
 	node->match = len;
+	node_set_id(node, id);
+	if (id > root->nb_match)
+		root->nb_match = id;
+	if (len > root->longest)
+		root->longest = len;
 	return 0;
 }
 
-struct fifo {
-	struct fifo_node *first;
-	struct fifo_node *last;
+/* Insert word in a tree */
+int ac_insert_wordl_flags(struct ac_root *root, char *word, size_t len, int flags)
+{
+	return ac_insert(root, word, len, flags, 1);
+}
+
+/* nodes of one level of the tree */
+struct ac_level {
+	struct ac_node **nodes;
+	size_t nb;
+	size_t size;
 };
 
-struct fifo_node {
+static inline
+int ac_level_push(struct ac_level *level, struct ac_node *node)
+{
+	struct ac_node **nodes;
+	size_t size;
+
+	if (level->nb == level->size) {
+		size = level->size == 0 ? 64 : level->size * 2;
+		nodes = realloc(level->nodes, size * sizeof(struct ac_node *));
+		if (nodes == NULL)
+			return -1;
+		level->nodes = nodes;
+		level->size = size;
+	}
+	level->nodes[level->nb++] = node;
+	return 0;
+}
+
+/* Compute the failure links of the children of the nodes <start> to <end>
+ * of the <level>, and append the children to the <next> level. Only the
+ * failure links of the nodes of the level and of the upper levels are
+ * read, so distinct parts of the same level can be processed in parallel.
+ */
+static
+int ac_fail_level(struct ac_root *root, struct ac_level *level, size_t start, size_t end,
+                  struct ac_level *next)
+{
 	struct ac_node *node;
-	struct fifo_node *next;
+	struct ac_node *child;
+	struct ac_node *fail_node;
+	size_t i;
+	int c;
+
+	for (i = start; i < end; i++) {
+		node = level->nodes[i];
+
+		/* browse only the populated children slots */
+		for (c = node->first; c <= node->last; c++) {
+
+			child = node->children[c - node->first];
+			if (child == NULL)
+				continue;
+
+			/* find fail link for this child. The root node has
+			 * no fail link, so its children fail to the root.
+			 */
+			fail_node = node->fail;
+			while (fail_node != NULL && node_get_children(fail_node, c) == NULL) {
+				fail_node = fail_node->fail;
+			}
+			if (fail_node == NULL) {
+				child->fail = root->root;
+			} else {
+				child->fail = node_get_children(fail_node, c);
+			}
+
+			/* append child to the next level */
+			if (ac_level_push(next, child) != 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Levels with less nodes are processed by the calling thread only */
+#define AC_PARALLEL_MIN_NODES 256
+
+/* Minimum part of the text counted by one thread */
+#define AC_PARALLEL_MIN_BYTES 4096
+
+struct ac_pool;
+
+struct ac_worker {
+	struct ac_pool *pool;
+	pthread_t thread;
+	int id;
+	int error;
+	struct ac_level next; /* children found by this worker */
+};
+
+/* Threads processing the parts of the current level. The calling thread
+ * is the worker 0.
+ */
+struct ac_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t start; /* signaled when a new level is ready */
+	pthread_cond_t done; /* signaled when the last worker ends its part */
+	unsigned int generation; /* incremented for each level */
+	int running; /* number of workers processing the level */
+	int stop;
+	int nb;
+	struct ac_root *root;
+	struct ac_level *level;
+	struct ac_worker *workers;
 };
 
+/* Process the part <id> of the current level */
 static inline
-void fifo_init(struct fifo *fifo)
+void ac_worker_process(struct ac_pool *pool, struct ac_worker *w)
 {
-	fifo->first = NULL;
-	fifo->last = NULL;
+	size_t nb = pool->level->nb;
+
+	if (ac_fail_level(pool->root, pool->level, nb * w->id / pool->nb,
+	                  nb * (w->id + 1) / pool->nb, &w->next) != 0)
+		w->error = 1;
 }
 
-static inline
-int fifo_push(struct fifo *fifo, struct ac_node *node)
+static
+void *ac_worker_run(void *arg)
 {
-	struct fifo_node *fn;
+	struct ac_worker *w = arg;
+	struct ac_pool *pool = w->pool;
+	unsigned int generation = 0;
 
-	fn = malloc(sizeof(struct fifo_node));
-	if (fn == NULL)
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stop && pool->generation == generation)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+			break;
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		ac_worker_process(pool, w);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->running--;
+		if (pool->running == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Stop and join the <nb> first threads of the pool */
+static
+void ac_pool_stop(struct ac_pool *pool, int nb)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 1; i < nb; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+}
+
+/* Compute the failure links level by level, from the root node. The
+ * failure links of a level depend only on the upper levels, so each
+ * level is spread across <nb> threads. The number of levels and of
+ * threads really used are stored in <st>.
+ */
+static
+int ac_fail_links(struct ac_root *root, int nb, struct ac_finalize_stats *st)
+{
+	struct ac_pool pool;
+	struct ac_level level;
+	struct ac_worker *w;
+	struct ac_node **nodes;
+	int error = 0;
+	int i;
+
+	memset(&level, 0, sizeof(level));
+	if (ac_level_push(&level, root->root) != 0)
+		return -1;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.workers = calloc(nb, sizeof(struct ac_worker));
+	if (pool.workers == NULL) {
+		free(level.nodes);
 		return -1;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.start, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.root = root;
+	pool.level = &level;
+	pool.nb = nb;
+	for (i = 0; i < nb; i++) {
+		pool.workers[i].pool = &pool;
+		pool.workers[i].id = i;
+		if (i > 0 && pthread_create(&pool.workers[i].thread, NULL, ac_worker_run, &pool.workers[i]) != 0) {
+			/* continue with the calling thread only */
+			ac_pool_stop(&pool, i);
+			nb = 1;
+			break;
+		}
+	}
+	st->threads = nb;
+
+	st->levels = 0;
+	while (!error && level.nb > 0) {
+
+		if (nb == 1 || level.nb < AC_PARALLEL_MIN_NODES) {
+			if (ac_fail_level(root, &level, 0, level.nb, &pool.workers[0].next) != 0)
+				pool.workers[0].error = 1;
+		} else {
+			/* wake up the workers and process the part 0 */
+			pthread_mutex_lock(&pool.lock);
+			pool.generation++;
+			pool.running = nb - 1;
+			pthread_cond_broadcast(&pool.start);
+			pthread_mutex_unlock(&pool.lock);
+
+			ac_worker_process(&pool, &pool.workers[0]);
+
+			pthread_mutex_lock(&pool.lock);
+			while (pool.running > 0)
+				pthread_cond_wait(&pool.done, &pool.lock);
+			pthread_mutex_unlock(&pool.lock);
+		}
+
+		/* the children found by the workers are the next level */
+		level.nb = 0;
+		for (i = 0; i < nb; i++) {
+			w = &pool.workers[i];
+			error |= w->error;
+			if (!error && level.size < level.nb + w->next.nb) {
+				nodes = realloc(level.nodes, (level.nb + w->next.nb) * sizeof(struct ac_node *));
+				if (nodes == NULL) {
+					error = 1;
+				} else {
+					level.nodes = nodes;
+					level.size = level.nb + w->next.nb;
+				}
+			}
+			if (!error)
+				memcpy(&level.nodes[level.nb], w->next.nodes, w->next.nb * sizeof(struct ac_node *));
+			level.nb += w->next.nb;
+			w->next.nb = 0;
+		}
+		st->levels++;
+	}
+
+	ac_pool_stop(&pool, nb);
+	for (i = 0; i < pool.nb; i++)
+		free(pool.workers[i].next.nodes);
+	free(pool.workers);
+	free(level.nodes);
+	pthread_cond_destroy(&pool.done);
+	pthread_cond_destroy(&pool.start);
+	pthread_mutex_destroy(&pool.lock);
+	return error ? -1 : 0;
+}
+
+#ifdef AC_HAVE_TEDDY
+
+/* Trees with more words use only the automaton */
+#define AC_TEDDY_MAX_WORDS 64
+
+/* Number of leading bytes of each word used as fingerprint */
+#define AC_TEDDY_MAX_BYTES 3
+
+/* The SIMD prefilter is a bucketed fingerprint of the first bytes of
+ * each word (Teddy algorithm). The prefixes are spread in 8 buckets,
+ * and for each fingerprint position, two 16 bytes tables give the
+ * buckets matching the low and the high nibble of the text byte. A
+ * text position is a candidate start if a bucket survives the AND of
+ * all the lookups. The prefilter doesn't report matches: it only skips
+ * the text while the automaton is on the root node, and the automaton
+ * itself verify the candidates. So the results are exactly the same.
+ */
+struct ac_teddy {
+	int n; /* number of fingerprint bytes */
+	unsigned char lo[AC_TEDDY_MAX_BYTES][16];
+	unsigned char hi[AC_TEDDY_MAX_BYTES][16];
+	size_t (*next)(struct ac_teddy *t, const char *text, size_t i, size_t len);
+};
+
+/* Return the first candidate start position from <i>. If the end of
+ * the text is too short for the SIMD load, <i> is returned and the
+ * automaton process the remaining bytes.
+ */
+__attribute__((target("ssse3")))
+static
+size_t ac_teddy_next_ssse3(struct ac_teddy *t, const char *text, size_t i, size_t len)
+{
+	__m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo[AC_TEDDY_MAX_BYTES];
+	__m128i hi[AC_TEDDY_MAX_BYTES];
+	__m128i res;
+	__m128i v;
+	unsigned int mask;
+	int k;
+
+	for (k = 0; k < t->n; k++) {
+		lo[k] = _mm_loadu_si128((__m128i *)t->lo[k]);
+		hi[k] = _mm_loadu_si128((__m128i *)t->hi[k]);
+	}
+
+	while (i + 16 + t->n - 1 <= len) {
+		res = _mm_set1_epi8(0xff);
+		for (k = 0; k < t->n; k++) {
+			v = _mm_loadu_si128((__m128i *)(text + i + k));
+			res = _mm_and_si128(res, _mm_shuffle_epi8(lo[k], _mm_and_si128(v, nibble)));
+			res = _mm_and_si128(res, _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+		}
+		mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(res, zero)) & 0xffff;
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+	return i;
+}
 
-	fn->node = node;
-	fn->next = NULL;
-	if (fifo->last != NULL) {
-		fifo->last->next = fn;
+/* Same than ac_teddy_next_ssse3() with 32 bytes blocs. The shuffle
+ * works on each 128 bits lane, so the tables are duplicated.
+ */
+__attribute__((target("avx2")))
+static
+size_t ac_teddy_next_avx2(struct ac_teddy *t, const char *text, size_t i, size_t len)
+{
+	__m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo[AC_TEDDY_MAX_BYTES];
+	__m256i hi[AC_TEDDY_MAX_BYTES];
+	__m256i res;
+	__m256i v;
+	unsigned int mask;
+	int k;
+
+	for (k = 0; k < t->n; k++) {
+		lo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)t->lo[k]));
+		hi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)t->hi[k]));
 	}
-	fifo->last = fn;
-	if (fifo->first == NULL) {
-		fifo->first = fn;
+
+	while (i + 32 + t->n - 1 <= len) {
+		res = _mm256_set1_epi8(0xff);
+		for (k = 0; k < t->n; k++) {
+			v = _mm256_loadu_si256((__m256i *)(text + i + k));
+			res = _mm256_and_si256(res, _mm256_shuffle_epi8(lo[k], _mm256_and_si256(v, nibble)));
+			res = _mm256_and_si256(res, _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+		}
+		mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(res, zero));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+		i += 32;
 	}
+	return ac_teddy_next_ssse3(t, text, i, len);
+}
+
+/* Set byte <c> at fingerprint position <k> for the <bucket> */
+static inline
+void ac_teddy_set(struct ac_teddy *t, int k, unsigned char c, int bucket)
+{
+	t->lo[k][c & 0x0f] |= 1 << bucket;
+	t->hi[k][c >> 4] |= 1 << bucket;
+}
+
+/* Browse the tree until depth t->n and register each prefix in its
+ * bucket. Each node of the tree leads to a word, so all the nodes at
+ * depth t->n are word prefixes.
+ */
+static
+void ac_teddy_add(struct ac_root *root, struct ac_teddy *t, struct ac_node *node,
+                  unsigned char *path, int depth, int *nb)
+{
+	struct ac_node *child;
+	int bucket;
+	int c;
+	int k;
+
+	if (depth == t->n) {
+		bucket = (*nb)++ & 7;
+		for (k = 0; k < t->n; k++) {
+			ac_teddy_set(t, k, path[k], bucket);
+			/* folded tree contains only lower case bytes */
+			if ((root->flags & AC_FOLD) && path[k] >= 'a' && path[k] <= 'z')
+				ac_teddy_set(t, k, path[k] - 'a' + 'A', bucket);
+		}
+		return;
+	}
+
+	for (c = node->first; c <= node->last; c++) {
+		child = node->children[c - node->first];
+		if (child == NULL)
+			continue;
+		path[depth] = c;
+		ac_teddy_add(root, t, child, path, depth + 1, nb);
+	}
+}
+
+/* Build the SIMD prefilter if the tree is small and the CPU support it */
+static
+int ac_teddy_build(struct ac_root *root)
+{
+	struct ac_teddy *t;
+	struct ac_node *n;
+	unsigned char path[AC_TEDDY_MAX_BYTES];
+	int min;
+	int nb;
+
+	if ((root->flags & (AC_NOSIMD | AC_REVERSE)) ||
+	    root->nb_match == 0 || root->nb_match > AC_TEDDY_MAX_WORDS)
+		return 0;
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("ssse3"))
+		return 0;
+
+	/* The fingerprint cannot be longer than the shortest word */
+	min = AC_TEDDY_MAX_BYTES;
+	for (n = root->root; n < NODEEND(root); n = NODENEXT(n))
+		if (n->match > 0 && n->match < min)
+			min = n->match;
 
+	t = calloc(1, sizeof(struct ac_teddy));
+	if (t == NULL)
+		return -1;
+	t->n = min;
+	t->next = __builtin_cpu_supports("avx2") ? ac_teddy_next_avx2 : ac_teddy_next_ssse3;
+	nb = 0;
+	ac_teddy_add(root, t, root->root, path, 0, &nb);
+
+	root->teddy = t;
 	return 0;
 }
 
+#else
+
 static inline
-struct ac_node *fifo_pop(struct fifo *fifo)
+int ac_teddy_build(struct ac_root *root)
 {
-	struct fifo_node *fn;
-	struct ac_node *node;
+	return 0;
+}
 
-	fn = fifo->first;
-	if (fn == NULL)
-		return NULL;
-	node = fn->node;
-	fifo->first = fn->next;
-	if (fifo->last == fn)
-		fifo->last = NULL;
-	free(fn);
-	return node;
+#endif
+
+static inline
+double ac_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
 }
 
 /* compute failure link */
-int ac_finalize(struct ac_root *root)
+int ac_finalize_threads(struct ac_root *root, int nb_threads, struct ac_finalize_stats *stats)
 {
-	struct ac_node *node;
-	struct ac_node *child;
-	struct ac_node *fail_node;
-	struct ac_node_browse bn;
-	int c;
-	struct fifo fifo;
+	struct ac_finalize_stats st;
 	char *new_bloc;
+	double start;
+	long nb;
+
+	if (nb_threads <= 0) {
+		nb = sysconf(_SC_NPROCESSORS_ONLN);
+		nb_threads = nb > 0 ? nb : 1;
+	}
 
 	/* Convert the mmap allocated bloc to malloc'ed memory
 	 * bloc and free the mmap bloc. When mmap id freed,
 	 * the memory is really free and retruned to the system.
 	 */
+	start = ac_now();
 	new_bloc = malloc(root->length);
 	if (new_bloc == NULL)
 		return -1;
 	memcpy(new_bloc, root->data, root->length);
 	munmap(root->data, root->total);
 	node_move(new_bloc, root, NULL, NULL);
+	st.copy = ac_now() - start;
+
+	/* configure "fail" links */
+	start = ac_now();
+	if (ac_fail_links(root, nb_threads, &st) != 0)
+		return -1;
+	st.fail = ac_now() - start;
 
-	/* winit fifo ill contains node waiting for processing */
-	fifo_init(&fifo);
+	/* Select SIMD prefilter for small trees */
+	start = ac_now();
+	if (ac_teddy_build(root) != 0)
+		return -1;
+	st.simd = ac_now() - start;
+
+	if (stats != NULL)
+		*stats = st;
+	return 0;
+}
+
+/* Browse the tree <src> and insert each of its words in <dst> with the
+ * <groups>. <path> contains the <depth> bytes leading to <node>, and
+ * <tmp> is a buffer of the same size.
+ */
+static
+int ac_merge_node(struct ac_root *dst, struct ac_root *src, struct ac_node *node,
+                  char *path, char *tmp, int depth, unsigned int groups)
+{
+	struct ac_match *m;
+	struct ac_word *w;
+	struct ac_node *child;
+	char *word;
+	int c;
+	int i;
 
-	/* Append all root's children to the process fifo */
-	for (node = node_browse_first(&bn, root->root); node != NULL; node = node_browse_next(&bn)) {
+	if (node->match > 0) {
+		/* The bytes leading to the node of a reversed tree are
+		 * the reversed word. ac_insert() expects the word.
+		 */
+		word = path;
+		if (src->flags & AC_REVERSE) {
+			for (i = 0; i < depth; i++)
+				tmp[i] = path[depth - 1 - i];
+			word = tmp;
+		}
 
-		/* first level node always have root as fail link */
-		node->fail = root->root;
+		if (src->matches == NULL) {
+			if (ac_insert(dst, word, depth, 0, groups) != 0)
+				return -1;
+		} else {
+			/* Folded tree contains the case insensitive word itself,
+			 * and a copy of the case sensitive words.
+			 */
+			m = &src->matches[node_get_id(node) - 1];
+			if (m->groups != 0 &&
+			    ac_insert(dst, word, depth, src->flags & AC_FOLD ? AC_NOCASE : 0, groups) != 0)
+				return -1;
+			for (w = m->words; w != NULL; w = w->next)
+				if (ac_insert(dst, w->word, w->length, 0, groups) != 0)
+					return -1;
+		}
+	}
 
-		/* Append node at last item of the queue */
-		if (fifo_push(&fifo, node) != 0)
+	for (c = node->first; c <= node->last; c++) {
+		child = node->children[c - node->first];
+		if (child == NULL)
+			continue;
+		path[depth] = c;
+		if (ac_merge_node(dst, src, child, path, tmp, depth + 1, groups) != 0)
 			return -1;
 	}
+	return 0;
+}
 
-	/* browse queue and configure "fail" links */
-	while (1) {
+/* Merge trees */
+int ac_merge(struct ac_root *dst, struct ac_root **src, int nb)
+{
+	struct ac_node *n;
+	char *word;
+	int flags;
+	int max;
+	int i;
 
-		/* Get first node of the queue */
-		node = fifo_pop(&fifo);
-		if (node == NULL)
-			break;
+	if (nb < 1 || nb > AC_MAX_GROUPS)
+		return -1;
 
-		/* browse childrens of current node */
-		for (c = 0; c < 256; c++) {
+	/* The merged tree is folded if at least one source is folded.
+	 * Case sensitive words of other sources are verified.
+	 */
+	flags = AC_GROUPS | (src[0]->flags & AC_REVERSE);
+	max = 0;
+	for (i = 0; i < nb; i++) {
+		if ((src[i]->flags & AC_REVERSE) != (flags & AC_REVERSE))
+			return -1;
+		flags |= src[i]->flags & (AC_FOLD | AC_NOSIMD);
+		for (n = src[i]->root; n < NODEEND(src[i]); n = NODENEXT(n))
+			if (n->match > max)
+				max = n->match;
+	}
 
-			child = node_get_children(node, c);
-			if (child == NULL)
-				continue;
+	if (!ac_init_root_flags(dst, flags))
+		return -1;
 
-			/* find fail link for this child */
-			fail_node = node->fail;
-			while (fail_node != NULL && node_get_children(fail_node, c) == NULL) {
-				fail_node = fail_node->fail;
-			}
-			if (fail_node == NULL) {
-				child->fail = root->root;
-			} else {
-				child->fail = node_get_children(fail_node, c);
-			}
+	word = malloc((max + 1) * 2);
+	if (word == NULL)
+		return -1;
+	for (i = 0; i < nb; i++) {
+		if (ac_merge_node(dst, src[i], src[i]->root, word, word + max + 1, 0, 1U << i) != 0) {
+			free(word);
+			return -1;
+		}
+	}
+	free(word);
 
-			/* append child to the fifo queue */
-			if (fifo_push(&fifo, child) != 0)
-				return -1;
+	return ac_finalize(dst);
+}
+
+/* Return the index of the node <n> in the memory bloc, which contains
+ * <nb> nodes starting at the <offsets>.
+ */
+static
+size_t ac_write_index(struct ac_root *root, size_t *offsets, size_t nb, struct ac_node *n)
+{
+	size_t offset;
+	size_t lo;
+	size_t hi;
+	size_t mid;
+
+	offset = (char *)n - root->data;
+	lo = 0;
+	hi = nb;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (offsets[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Write the list of case sensitive words starting at <w>, the last one
+ * first because each word points to the next. Return the number of the
+ * last written word.
+ */
+static
+size_t ac_write_words(struct ac_word *w, FILE *out, const char *name, size_t *nb)
+{
+	size_t next = 0;
+	size_t i;
+
+	if (w->next != NULL)
+		next = ac_write_words(w->next, out, name, nb);
+
+	fprintf(out, "static const struct {\n"
+	             "\tstruct ac_word *next;\n"
+	             "\tunsigned int groups;\n"
+	             "\tsize_t length;\n"
+	             "\tchar word[%zu];\n"
+	             "} %s_word%zu = {\n", w->length, name, *nb);
+	if (w->next != NULL)
+		fprintf(out, "\t(struct ac_word *)&%s_word%zu,\n", name, next);
+	else
+		fprintf(out, "\tNULL,\n");
+	fprintf(out, "\t0x%x,\n\t%zu,\n\t{", w->groups, w->length);
+	for (i = 0; i < w->length; i++)
+		fprintf(out, "%s0x%02x", i == 0 ? " " : ", ", (unsigned char)w->word[i]);
+	fprintf(out, " }\n};\n\n");
+
+	return (*nb)++;
+}
+
+/* Write finalized tree as C code */
+int ac_write_c(struct ac_root *root, FILE *out, const char *name)
+{
+	struct ac_node *n;
+	size_t *offsets;
+	size_t *words;
+	size_t nb;
+	size_t nb_words;
+	size_t i;
+	char used[2][257];
+	int c;
+
+	/* Index the offset of each node */
+	nb = 0;
+	for (n = root->root; n < NODEEND(root); n = NODENEXT(n))
+		nb++;
+	offsets = malloc(nb * sizeof(size_t));
+	if (offsets == NULL)
+		return -1;
+	nb = 0;
+	memset(used, 0, sizeof(used));
+	for (n = root->root; n < NODEEND(root); n = NODENEXT(n)) {
+		offsets[nb++] = (char *)n - root->data;
+		used[n->match > 0][NODESLOTS(n)] = 1;
+	}
+
+	fprintf(out, "/* Generated file, do not edit */\n\n"
+	             "#include \"aho-corasick.h\"\n\n");
+
+	/* One node type for each number of children slots, with or without
+	 * match identifier. The layout is the same than struct ac_node with
+	 * its children array and its identifier.
+	 */
+	for (i = 0; i <= 256; i++) {
+		for (c = 0; c < 2; c++) {
+			if (!used[c][i])
+				continue;
+			fprintf(out, "struct %s_node%zu%s {\n"
+			             "\tshort match;\n"
+			             "\tunsigned char first;\n"
+			             "\tunsigned char last;\n"
+			             "\tstruct ac_node *fail;\n", name, i, c ? "_id" : "");
+			if (i > 0)
+				fprintf(out, "\tstruct ac_node *children[%zu];\n", i);
+			if (c)
+				fprintf(out, "\tunsigned int id;\n");
+			fprintf(out, "} __attribute__((packed));\n\n");
 		}
 	}
 
+	/* Match descriptors and their case sensitive words */
+	if (root->matches != NULL) {
+		words = malloc(root->nb_match * sizeof(size_t));
+		if (words == NULL) {
+			free(offsets);
+			return -1;
+		}
+		nb_words = 0;
+		for (i = 0; i < root->nb_match; i++)
+			if (root->matches[i].words != NULL)
+				words[i] = ac_write_words(root->matches[i].words, out, name, &nb_words);
+		fprintf(out, "static const struct ac_match %s_matches[%u] = {\n", name, root->nb_match);
+		for (i = 0; i < root->nb_match; i++) {
+			if (root->matches[i].words != NULL)
+				fprintf(out, "\t{ 0x%x, (struct ac_word *)&%s_word%zu },\n",
+				        root->matches[i].groups, name, words[i]);
+			else
+				fprintf(out, "\t{ 0x%x, NULL },\n", root->matches[i].groups);
+		}
+		fprintf(out, "};\n\n");
+		free(words);
+	}
+
+	/* The nodes are members of one struct, so they are contiguous
+	 * like in the memory bloc.
+	 */
+	fprintf(out, "static const struct {\n");
+	i = 0;
+	for (n = root->root; n < NODEEND(root); n = NODENEXT(n))
+		fprintf(out, "\tstruct %s_node%d%s n%zu;\n", name, NODESLOTS(n), n->match > 0 ? "_id" : "", i++);
+	fprintf(out, "} __attribute__((packed)) %s_nodes = {\n", name);
+	for (n = root->root; n < NODEEND(root); n = NODENEXT(n)) {
+		fprintf(out, "\t{ %d, %d, %d, ", n->match, n->first, n->last);
+		if (n->fail != NULL)
+			fprintf(out, "(struct ac_node *)&%s_nodes.n%zu", name, ac_write_index(root, offsets, nb, n->fail));
+		else
+			fprintf(out, "NULL");
+		if (NODESLOTS(n) > 0) {
+			fprintf(out, ", {");
+			for (c = n->first; c <= n->last; c++) {
+				fprintf(out, "%s", c == n->first ? " " : ", ");
+				if (n->children[c - n->first] != NULL)
+					fprintf(out, "(struct ac_node *)&%s_nodes.n%zu", name,
+					        ac_write_index(root, offsets, nb, n->children[c - n->first]));
+				else
+					fprintf(out, "NULL");
+			}
+			fprintf(out, " }");
+		}
+		if (n->match > 0)
+			fprintf(out, ", %u", node_get_id(n));
+		fprintf(out, " },\n");
+	}
+	fprintf(out, "};\n\n");
+	free(offsets);
+
+	fprintf(out, "static const struct ac_root %s = {\n"
+	             "\t.root = (struct ac_node *)&%s_nodes.n0,\n"
+	             "\t.data = (char *)&%s_nodes,\n"
+	             "\t.length = sizeof(%s_nodes),\n"
+	             "\t.total = 0,\n"
+	             "\t.flags = 0x%x,\n"
+	             "\t.nb_match = %u,\n"
+	             "\t.longest = %zu,\n",
+	        name, name, name, name, root->flags, root->nb_match, root->longest);
+	if (root->matches != NULL)
+		fprintf(out, "\t.matches = (struct ac_match *)%s_matches,\n"
+		             "\t.matches_size = %u,\n", name, root->nb_match);
+	else
+		fprintf(out, "\t.matches = NULL,\n"
+		             "\t.matches_size = 0,\n");
+	fprintf(out, "\t.teddy = NULL,\n"
+	             "};\n");
+
+	if (ferror(out))
+		return -1;
 	return 0;
 }
 
 #define AC_RESULT(__x, __y) ((struct ac_result){.word = (__x), .length = (__y)})
 
+/* Return the enabled groups of the candidate match of <node>. Only case
+ * sensitive words of folded trees are verified against the original bytes
+ * of the text starting at <text>. Return 0 if the match is rejected.
+ */
+static inline
+unsigned int ac_verify(const struct ac_root *root, unsigned int mask,
+                       struct ac_node *node, const char *text)
+{
+	struct ac_match *m;
+	struct ac_word *w;
+	unsigned int groups;
+
+	if (root->matches == NULL)
+		return mask & 1;
+	m = &root->matches[node_get_id(node) - 1];
+	groups = m->groups;
+	for (w = m->words; w != NULL; w = w->next) {
+		/* only one word of the node could match the text */
+		if (memcmp(w->word, text, w->length) == 0) {
+			groups |= w->groups;
+			break;
+		}
+	}
+	return groups & mask;
+}
+
+/* Browsing loop modes. Each loop is built for one mode, so the trees
+ * without these features browse the text like the original loop.
+ */
+#define AC_LOOP_FOLD   0x1 /* fold the text bytes */
+#define AC_LOOP_VERIFY 0x2 /* verify the candidate matches */
+#define AC_LOOP_TEDDY  0x4 /* skip the text with the SIMD prefilter */
+
+/* Return the browsing loop mode of <root> for the groups <mask> */
+static inline
+int ac_loop_mode(const struct ac_root *root, unsigned int mask)
+{
+	int mode = 0;
+
+	if (root->flags & AC_FOLD)
+		mode |= AC_LOOP_FOLD;
+	if (root->matches != NULL || !(mask & 1))
+		mode |= AC_LOOP_VERIFY;
+#ifdef AC_HAVE_TEDDY
+	if (root->teddy != NULL)
+		mode |= AC_LOOP_TEDDY;
+#endif
+	return mode;
+}
+
 // Fonction pour rechercher des mots dans le texte  l'aide de l'arbre de recherche de motifs
-struct ac_result ac_search_next(struct ac_search *ac)
+static inline __attribute__((always_inline))
+struct ac_result ac_search_loop(struct ac_search *ac, const int mode)
 {
 	unsigned char c;
-	register int i;
+	register size_t i;
 	register short match;
 
 	/* load counter in stack variable. This increase speed avoid dereference on each loop */
@@ -469,7 +1322,17 @@ struct ac_result ac_search_next(struct ac_search *ac)
 	}
 
 	for (i = 0; i < ac->length; i++) {
+#ifdef AC_HAVE_TEDDY
+		/* No word in progress, jump to the next candidate start */
+		if ((mode & AC_LOOP_TEDDY) && ac->node == ac->root->root) {
+			i = ac->root->teddy->next(ac->root->teddy, ac->text, i, ac->length);
+			if (i >= ac->length)
+				break;
+		}
+#endif
 		c = (unsigned char)ac->text[i];
+		if (mode & AC_LOOP_FOLD)
+			c = ac_fold(c);
 		while (ac->node != NULL && node_get_children(ac->node, c) == NULL) {
 			ac->node = ac->node->fail;
 		}
@@ -479,9 +1342,12 @@ struct ac_result ac_search_next(struct ac_search *ac)
 			ac->node = node_get_children(ac->node, c);
 			match = ac->node->match;
 			if (match > 0) {
-				ac->step = 1;
-				ac->i = i;
-				return AC_RESULT(&ac->text[i - match + 1], match);
+				if (!(mode & AC_LOOP_VERIFY) ||
+				    (ac->groups = ac_verify(ac->root, ac->mask, ac->node, &ac->text[i - match + 1])) != 0) {
+					ac->step = 1;
+					ac->i = i;
+					return AC_RESULT(&ac->text[i - match + 1], match);
+				}
 			}
 continue_step_1:
 			ac->fail_node = ac->node->fail;
@@ -489,9 +1355,12 @@ continue_step_1:
 			while (ac->fail_node != NULL) {
 				match = ac->fail_node->match;
 				if (match > 0) {
-					ac->step = 2;
-					ac->i = i;
-					return AC_RESULT(&ac->text[i - match + 1], match);
+					if (!(mode & AC_LOOP_VERIFY) ||
+					    (ac->groups = ac_verify(ac->root, ac->mask, ac->fail_node, &ac->text[i - match + 1])) != 0) {
+						ac->step = 2;
+						ac->i = i;
+						return AC_RESULT(&ac->text[i - match + 1], match);
+					}
 				}
 continue_step_2:
 				ac->fail_node = ac->fail_node->fail;
@@ -501,20 +1370,549 @@ continue_step_2:
 	return AC_RESULT(NULL, 0);
 }
 
-struct ac_result ac_search_firstl(struct ac_search *ac, struct ac_root *root, char *text, size_t length)
+/* One browsing function per loop mode */
+#define AC_SEARCH_LOOP(__m) \
+	static __attribute__((noinline)) \
+	struct ac_result ac_search_loop##__m(struct ac_search *ac) \
+	{ \
+		return ac_search_loop(ac, __m); \
+	}
+AC_SEARCH_LOOP(0)
+AC_SEARCH_LOOP(1)
+AC_SEARCH_LOOP(2)
+AC_SEARCH_LOOP(3)
+AC_SEARCH_LOOP(4)
+AC_SEARCH_LOOP(5)
+AC_SEARCH_LOOP(6)
+AC_SEARCH_LOOP(7)
+
+struct ac_result ac_search_next(struct ac_search *ac)
+{
+	switch (ac->mode) {
+	case 0: return ac_search_loop0(ac);
+	case 1: return ac_search_loop1(ac);
+	case 2: return ac_search_loop2(ac);
+	case 3: return ac_search_loop3(ac);
+	case 4: return ac_search_loop4(ac);
+	case 5: return ac_search_loop5(ac);
+	case 6: return ac_search_loop6(ac);
+	default: return ac_search_loop7(ac);
+	}
+}
+
+static inline
+void ac_search_init(struct ac_search *ac, const struct ac_root *root,
+                    char *text, size_t length, unsigned int mask)
 {
+	ac->mode = ac_loop_mode(root, mask);
+	ac->mask = mask;
+	ac->groups = 1; /* only changed by the verification */
 	ac->text = text;
 	ac->length = length;
 	ac->root = root;
 	ac->node = root->root;
 	ac->step = 0;
+}
+
+/* The node of the last result is the current node for the step 1, and
+ * its fail node for the step 2.
+ */
+unsigned int ac_search_id(const struct ac_search *ac)
+{
+	return node_get_id(ac->step == 1 ? ac->node : ac->fail_node);
+}
+
+struct ac_result ac_search_firstl_groups(struct ac_search *ac, const struct ac_root *root,
+                                         char *text, size_t length, unsigned int mask)
+{
+	ac_search_init(ac, root, text, length, mask);
 
+	/* Reversed trees are only browsed backward */
+	if (root->flags & AC_REVERSE) {
+		ac->length = 0;
+		return AC_RESULT(NULL, 0);
+	}
 	return ac_search_next(ac);
 }
 
-struct ac_result ac_searchl(struct ac_root *root, char *text, size_t length)
+struct ac_result ac_searchl(const struct ac_root *root, char *text, size_t length)
 {
 	struct ac_search ac;
 
 	return ac_search_firstl(&ac, root, text, length);
 }
+
+/* Same than ac_search_loop(), but browse the text from its end with a
+ * reversed tree. The word matched by a node starts at the current byte.
+ * Reversed trees have no SIMD prefilter.
+ */
+static inline __attribute__((always_inline))
+struct ac_result ac_search_prev_loop(struct ac_search *ac, const int mode)
+{
+	unsigned char c;
+	register size_t i;
+	register short match;
+
+	/* load counter in stack variable. This increase speed avoid dereference on each loop */
+	i = ac->i;
+
+	/* continue function at last stop */
+	switch (ac->step) {
+	case 0: break;
+	case 1: goto continue_step_1;
+	case 2: goto continue_step_2;
+	}
+
+	for (i = ac->length; i-- > 0; ) {
+		c = (unsigned char)ac->text[i];
+		if (mode & AC_LOOP_FOLD)
+			c = ac_fold(c);
+		while (ac->node != NULL && node_get_children(ac->node, c) == NULL) {
+			ac->node = ac->node->fail;
+		}
+		if (ac->node == NULL) {
+			ac->node = ac->root->root;
+		} else {
+			ac->node = node_get_children(ac->node, c);
+			match = ac->node->match;
+			if (match > 0) {
+				if (!(mode & AC_LOOP_VERIFY) ||
+				    (ac->groups = ac_verify(ac->root, ac->mask, ac->node, &ac->text[i])) != 0) {
+					ac->step = 1;
+					ac->i = i;
+					return AC_RESULT(&ac->text[i], match);
+				}
+			}
+continue_step_1:
+			ac->fail_node = ac->node->fail;
+			/* Check if fail nodes match */
+			while (ac->fail_node != NULL) {
+				match = ac->fail_node->match;
+				if (match > 0) {
+					if (!(mode & AC_LOOP_VERIFY) ||
+					    (ac->groups = ac_verify(ac->root, ac->mask, ac->fail_node, &ac->text[i])) != 0) {
+						ac->step = 2;
+						ac->i = i;
+						return AC_RESULT(&ac->text[i], match);
+					}
+				}
+continue_step_2:
+				ac->fail_node = ac->fail_node->fail;
+			}
+		}
+	}
+	return AC_RESULT(NULL, 0);
+}
+
+#define AC_SEARCH_PREV_LOOP(__m) \
+	static __attribute__((noinline)) \
+	struct ac_result ac_search_prev_loop##__m(struct ac_search *ac) \
+	{ \
+		return ac_search_prev_loop(ac, __m); \
+	}
+AC_SEARCH_PREV_LOOP(0)
+AC_SEARCH_PREV_LOOP(1)
+AC_SEARCH_PREV_LOOP(2)
+AC_SEARCH_PREV_LOOP(3)
+
+struct ac_result ac_search_prev(struct ac_search *ac)
+{
+	switch (ac->mode & (AC_LOOP_FOLD | AC_LOOP_VERIFY)) {
+	case 0: return ac_search_prev_loop0(ac);
+	case 1: return ac_search_prev_loop1(ac);
+	case 2: return ac_search_prev_loop2(ac);
+	default: return ac_search_prev_loop3(ac);
+	}
+}
+
+struct ac_result ac_search_lastl_groups(struct ac_search *ac, const struct ac_root *root,
+                                        char *text, size_t length, unsigned int mask)
+{
+	ac_search_init(ac, root, text, length, mask);
+
+	/* Forward trees are only browsed forward */
+	if (!(root->flags & AC_REVERSE)) {
+		ac->length = 0;
+		return AC_RESULT(NULL, 0);
+	}
+	return ac_search_prev(ac);
+}
+
+/* Follow the children links from the root node with the last bytes of
+ * the text. The fail links are never used, so the browsing stops at the
+ * first byte without children.
+ */
+struct ac_result ac_search_suffixl(const struct ac_root *root, char *text, size_t length)
+{
+	struct ac_node *node;
+	unsigned char c;
+	size_t i;
+
+	if (!(root->flags & AC_REVERSE))
+		return AC_RESULT(NULL, 0);
+
+	node = root->root;
+	for (i = length; i > 0; i--) {
+		c = (unsigned char)text[i - 1];
+		if (root->flags & AC_FOLD)
+			c = ac_fold(c);
+		node = node_get_children(node, c);
+		if (node == NULL)
+			break;
+		if (node->match > 0 && ac_verify(root, ~0U, node, &text[i - 1]) != 0)
+			return AC_RESULT(&text[i - 1], node->match);
+	}
+	return AC_RESULT(NULL, 0);
+}
+
+/* Count the matches ending from the byte <from> to the byte <end>. The
+ * browsing starts at the byte <start>, before <from> if the previous
+ * bytes could be the start of words ending after <from>. The matches
+ * are added to <counts> if not NULL. Return the number of matches.
+ */
+static inline __attribute__((always_inline))
+size_t ac_count_loop(const struct ac_root *root, char *text, size_t start, size_t from,
+                     size_t end, unsigned long *counts, const int mode)
+{
+	struct ac_node *node;
+	struct ac_node *n;
+	unsigned char c;
+	size_t total;
+	size_t i;
+
+	total = 0;
+	node = root->root;
+	for (i = start; i < end; i++) {
+#ifdef AC_HAVE_TEDDY
+		/* No word in progress, jump to the next candidate start */
+		if ((mode & AC_LOOP_TEDDY) && node == root->root) {
+			i = root->teddy->next(root->teddy, text, i, end);
+			if (i >= end)
+				break;
+		}
+#endif
+		c = (unsigned char)text[i];
+		if (mode & AC_LOOP_FOLD)
+			c = ac_fold(c);
+		while (node != NULL && node_get_children(node, c) == NULL) {
+			node = node->fail;
+		}
+		if (node == NULL) {
+			node = root->root;
+			continue;
+		}
+		node = node_get_children(node, c);
+		if (i < from)
+			continue;
+
+		/* The node and its fail nodes match */
+		for (n = node; n != NULL; n = n->fail) {
+			if (n->match == 0)
+				continue;
+			if ((mode & AC_LOOP_VERIFY) && ac_verify(root, ~0U, n, &text[i - n->match + 1]) == 0)
+				continue;
+			total++;
+			if (counts != NULL)
+				counts[node_get_id(n) - 1]++;
+		}
+	}
+	return total;
+}
+
+static
+size_t ac_count_range(const struct ac_root *root, char *text, size_t start, size_t from,
+                      size_t end, unsigned long *counts)
+{
+	switch (ac_loop_mode(root, ~0U)) {
+	case 0: return ac_count_loop(root, text, start, from, end, counts, 0);
+	case 1: return ac_count_loop(root, text, start, from, end, counts, 1);
+	case 2: return ac_count_loop(root, text, start, from, end, counts, 2);
+	case 3: return ac_count_loop(root, text, start, from, end, counts, 3);
+	case 4: return ac_count_loop(root, text, start, from, end, counts, 4);
+	case 5: return ac_count_loop(root, text, start, from, end, counts, 5);
+	case 6: return ac_count_loop(root, text, start, from, end, counts, 6);
+	default: return ac_count_loop(root, text, start, from, end, counts, 7);
+	}
+}
+
+/* One part of the text counted by a thread */
+struct ac_count_part {
+	const struct ac_root *root;
+	char *text;
+	size_t start;
+	size_t from;
+	size_t end;
+	unsigned long *counts; /* counters of this thread */
+	size_t total;
+	pthread_t thread;
+	int running; /* the thread was started */
+};
+
+static
+void *ac_count_run(void *arg)
+{
+	struct ac_count_part *p = arg;
+
+	p->total = ac_count_range(p->root, p->text, p->start, p->from, p->end, p->counts);
+	return NULL;
+}
+
+/* Count matches. The text is split in one part per thread, and each part
+ * starts the browsing the length of the longest word minus one before its
+ * first byte, so the words crossing the parts are found. Only the matches
+ * ending in the part are counted. Each thread has its counters, added to
+ * <counts> at the end.
+ */
+size_t ac_countl_threads(const struct ac_root *root, char *text, size_t length,
+                         unsigned long *counts, int nb_threads)
+{
+	struct ac_count_part *parts;
+	struct ac_count_part *p;
+	size_t total;
+	size_t back;
+	long nb;
+	unsigned int j;
+	int i;
+
+	if (root->flags & AC_REVERSE)
+		return 0;
+
+	if (nb_threads <= 0) {
+		nb = sysconf(_SC_NPROCESSORS_ONLN);
+		nb_threads = nb > 0 ? nb : 1;
+	}
+	if (nb_threads > length / AC_PARALLEL_MIN_BYTES)
+		nb_threads = length / AC_PARALLEL_MIN_BYTES;
+	if (nb_threads <= 1)
+		return ac_count_range(root, text, 0, 0, length, counts);
+
+	parts = calloc(nb_threads, sizeof(struct ac_count_part));
+	if (parts == NULL)
+		return ac_count_range(root, text, 0, 0, length, counts);
+
+	back = root->longest > 0 ? root->longest - 1 : 0;
+	for (i = 0; i < nb_threads; i++) {
+		p = &parts[i];
+		p->root = root;
+		p->text = text;
+		p->from = length * i / nb_threads;
+		p->end = length * (i + 1) / nb_threads;
+		p->start = p->from > back ? p->from - back : 0;
+
+		/* The part 0 and the parts which cannot get their counters or
+		 * their thread are processed by the calling thread, with the
+		 * final counters.
+		 */
+		if (i == 0 || counts == NULL)
+			p->counts = NULL;
+		else
+			p->counts = calloc(root->nb_match, sizeof(unsigned long));
+		if (i > 0 && (counts == NULL || p->counts != NULL) &&
+		    pthread_create(&p->thread, NULL, ac_count_run, p) == 0)
+			p->running = 1;
+	}
+
+	total = 0;
+	for (i = 0; i < nb_threads; i++) {
+		p = &parts[i];
+		if (!p->running) {
+			free(p->counts);
+			total += ac_count_range(root, text, p->start, p->from, p->end, counts);
+		}
+	}
+	for (i = 1; i < nb_threads; i++) {
+		p = &parts[i];
+		if (!p->running)
+			continue;
+		pthread_join(p->thread, NULL);
+		total += p->total;
+		if (p->counts != NULL) {
+			for (j = 0; j < root->nb_match; j++)
+				counts[j] += p->counts[j];
+			free(p->counts);
+		}
+	}
+	free(parts);
+	return total;
+}
+
+/* Return the number of NUMA nodes of the system, 1 if unknown */
+static
+int ac_numa_nodes(void)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int node;
+	int nb;
+
+	nb = 1;
+	dir = opendir("/sys/devices/system/node");
+	if (dir == NULL)
+		return nb;
+	while ((ent = readdir(dir)) != NULL) {
+		if (sscanf(ent->d_name, "node%d", &node) == 1 && node >= nb)
+			nb = node + 1;
+	}
+	closedir(dir);
+	if (nb > AC_MAX_NUMA_NODES)
+		nb = AC_MAX_NUMA_NODES;
+	return nb;
+}
+
+/* Fill the NUMA node of each CPU from the cpu<N> entries of each node
+ * directory. Unknown CPUs stay on the node 0.
+ */
+static
+int ac_numa_cpus(struct ac_replicas *replicas)
+{
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+	int node;
+	int cpu;
+
+	replicas->nb_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (replicas->nb_cpus <= 0)
+		replicas->nb_cpus = 1;
+	replicas->cpu_nodes = calloc(replicas->nb_cpus, sizeof(int));
+	if (replicas->cpu_nodes == NULL)
+		return -1;
+
+	for (node = 1; node < replicas->nb; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+		dir = opendir(path);
+		if (dir == NULL)
+			continue;
+		while ((ent = readdir(dir)) != NULL) {
+			if (sscanf(ent->d_name, "cpu%d", &cpu) == 1 && cpu >= 0 && cpu < replicas->nb_cpus)
+				replicas->cpu_nodes[cpu] = node;
+		}
+		closedir(dir);
+	}
+	return 0;
+}
+
+/* Round <x> up to the alignment <a>, which is a power of 2 */
+#define AC_ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* Copy the finalized tree <src> in <dst>. The nodes, the match descriptors
+ * and the SIMD prefilter are copied in one memory bloc. If <bind> is set,
+ * the bloc is allocated on the NUMA <node>. The nodes links are relocated
+ * like when the memory bloc moves during the tree construction.
+ */
+static
+int ac_clone_numa(struct ac_root *dst, const struct ac_root *src, int node, int bind)
+{
+#ifdef SYS_mbind
+	unsigned long mask;
+#endif
+	size_t matches, matches_ofs;
+	size_t teddy, teddy_ofs;
+	size_t size;
+	char *bloc;
+
+	/* The nodes are packed, so each following part starts at its
+	 * own alignment.
+	 */
+	matches = src->matches != NULL ? src->nb_match * sizeof(struct ac_match) : 0;
+	matches_ofs = AC_ALIGN(src->length, _Alignof(struct ac_match));
+	size = matches_ofs + matches;
+	teddy = 0;
+	teddy_ofs = size;
+#ifdef AC_HAVE_TEDDY
+	if (src->teddy != NULL) {
+		teddy = sizeof(struct ac_teddy);
+		teddy_ofs = AC_ALIGN(size, _Alignof(struct ac_teddy));
+		size = teddy_ofs + teddy;
+	}
+#endif
+
+	bloc = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (bloc == MAP_FAILED)
+		return -1;
+
+	/* The pages are allocated on the first write, so the policy
+	 * must be set before the copy. Errors are ignored, the copy
+	 * is usable anywhere.
+	 */
+#ifdef SYS_mbind
+	if (bind) {
+		/* The kernel reads maxnode - 1 bits of the mask */
+		mask = 1UL << node;
+		syscall(SYS_mbind, bloc, size, MPOL_PREFERRED, &mask, AC_MAX_NUMA_NODES + 1, 0);
+	}
+#endif
+
+	memcpy(bloc, src->data, src->length);
+	*dst = *src;
+	dst->total = size;
+	node_move(bloc, dst, NULL, NULL);
+
+	if (matches > 0) {
+		dst->matches = (struct ac_match *)(bloc + matches_ofs);
+		memcpy(dst->matches, src->matches, matches);
+		dst->matches_size = src->nb_match;
+	}
+#ifdef AC_HAVE_TEDDY
+	if (teddy > 0) {
+		dst->teddy = (struct ac_teddy *)(bloc + teddy_ofs);
+		memcpy(dst->teddy, src->teddy, teddy);
+	}
+#endif
+	return 0;
+}
+
+/* Copy the tree on each NUMA node */
+int ac_replicate(struct ac_replicas *replicas, const struct ac_root *root)
+{
+	int i;
+
+	replicas->nb = ac_numa_nodes();
+	replicas->cpu_nodes = NULL;
+	replicas->roots = calloc(replicas->nb, sizeof(struct ac_root));
+	if (replicas->roots == NULL)
+		return -1;
+	if (ac_numa_cpus(replicas) != 0) {
+		replicas->nb = 0;
+		ac_replicas_free(replicas);
+		return -1;
+	}
+
+	for (i = 0; i < replicas->nb; i++) {
+		if (ac_clone_numa(&replicas->roots[i], root, i, replicas->nb > 1) != 0) {
+			replicas->nb = i;
+			ac_replicas_free(replicas);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Return the copy of the calling thread NUMA node. sched_getcpu() is
+ * served by the vDSO, without system call.
+ */
+const struct ac_root *ac_replica(const struct ac_replicas *replicas)
+{
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= replicas->nb_cpus)
+		return &replicas->roots[0];
+	return &replicas->roots[replicas->cpu_nodes[cpu]];
+}
+
+/* Release the copies, the match descriptors and the SIMD prefilter are
+ * in the nodes memory bloc.
+ */
+void ac_replicas_free(struct ac_replicas *replicas)
+{
+	int i;
+
+	for (i = 0; i < replicas->nb; i++)
+		munmap(replicas->roots[i].data, replicas->roots[i].total);
+	free(replicas->roots);
+	free(replicas->cpu_nodes);
+	replicas->roots = NULL;
+	replicas->cpu_nodes = NULL;
+	replicas->nb = 0;
+}
@@ -3,8 +3,24 @@
 #ifndef __AHO_CORASICK_H__
 #define __AHO_CORASICK_H__
 
+#include <stdio.h>
 #include <string.h>
 
+/* root flags */
+#define AC_FOLD   0x1 /* tree is ASCII case folded, required for AC_NOCASE words */
+#define AC_NOSIMD 0x2 /* never use the SIMD prefilter, even for small trees */
+#define AC_GROUPS 0x4 /* words are tagged with groups, set by ac_merge() */
+#define AC_REVERSE 0x8 /* words are indexed reversed, for backward search */
+
+/* max number of groups of a merged tree */
+#define AC_MAX_GROUPS 32
+
+/* word flags */
+#define AC_NOCASE 0x1 /* word matches regardless of the ASCII case */
+
+/* Nodes with match > 0 are followed, after the children array, by their
+ * unsigned int match identifier starting from 1.
+ */
 struct ac_node {
 	short match;
 	/* if last == 0 and first == 1, array id empty */
@@ -12,23 +28,48 @@ struct ac_node {
 	unsigned char last; /* last byte set in the array */
 	struct ac_node *fail; /* fallback to this node if browsing fails */
 	struct ac_node *children[0]; /* array of childrens */
-} __attribute((packed))__;
+} __attribute__((packed));
+
+/* case sensitive word stored in a folded tree */
+struct ac_word {
+	struct ac_word *next; /* next case sensitive word ending on the same node */
+	unsigned int groups; /* groups of this word */
+	size_t length;
+	char word[0];
+};
+
+/* match descriptor, only used by folded or grouped trees */
+struct ac_match {
+	unsigned int groups; /* groups of the words accepted without verification */
+	struct ac_word *words; /* case sensitive words to verify against the text */
+};
+
+struct ac_teddy;
 
 struct ac_root {
 	struct ac_node *root; /* root node, the pointer could change during tree contruction */
 	char *data; /* the pointer of the current memory bloc */
 	size_t length; /* the length of data used in the memory bloc */
 	size_t total; /* the real size of the memory bloc */
+	int flags; /* AC_FOLD, AC_NOSIMD, AC_GROUPS, AC_REVERSE */
+	unsigned int nb_match; /* number of match identifiers */
+	size_t longest; /* length of the longest word */
+	struct ac_match *matches; /* match descriptors indexed by id - 1, only with AC_FOLD or AC_GROUPS */
+	unsigned int matches_size; /* number of allocated match descriptors */
+	struct ac_teddy *teddy; /* SIMD prefilter selected by ac_finalize, NULL if not used */
 };
 
 struct ac_search {
 	char *text;
 	size_t length;
-	struct ac_root *root;
+	const struct ac_root *root;
 	struct ac_node *node;
 	struct ac_node *fail_node;
-	int i;
+	unsigned int mask; /* enabled groups */
+	unsigned int groups; /* groups of the last result */
+	size_t i;
 	int step;
+	int mode; /* browsing loop selected when the search starts */
 	unsigned char c;
 };
 
@@ -37,11 +78,28 @@ struct ac_result {
 	size_t length;
 };
 
+/* Init root node with flags. Use AC_FOLD to mix case sensitive and
+ * case insensitive words in the same tree. Use AC_REVERSE to build a
+ * tree for the backward search functions.
+ */
+int ac_init_root_flags(struct ac_root *root, int flags);
+
 /* Init root node */
-int ac_init_root(struct ac_root *root);
+static inline int ac_init_root(struct ac_root *root)
+{
+	return ac_init_root_flags(root, 0);
+}
+
+/* Insert word in the aho-corasick tree with length and flags. AC_NOCASE
+ * is accepted only if the tree was initialized with AC_FOLD.
+ */
+int ac_insert_wordl_flags(struct ac_root *root, char *word, size_t len, int flags);
 
 /* Insert word in the aho-corasick tree with length */
-int ac_insert_wordl(struct ac_root *root, char *word, size_t len);
+static inline int ac_insert_wordl(struct ac_root *root, char *word, size_t len)
+{
+	return ac_insert_wordl_flags(root, word, len, 0);
+}
 
 /* Insert word in the aho-corasick tree without length */
 static inline int ac_insert_word(struct ac_root *root, char *word)
@@ -49,29 +107,169 @@ static inline int ac_insert_word(struct ac_root *root, char *word)
 	return ac_insert_wordl(root, word, strlen(word));
 }
 
-/* Finalize aho-corasick index. Never insert words after calling this function */
-int ac_finalize(struct ac_root *root);
+/* Insert word in the aho-corasick tree with flags and without length */
+static inline int ac_insert_word_flags(struct ac_root *root, char *word, int flags)
+{
+	return ac_insert_wordl_flags(root, word, strlen(word), flags);
+}
+
+/* time spent by each phase of the finalization */
+struct ac_finalize_stats {
+	double copy; /* seconds to move the tree in its final memory bloc */
+	double fail; /* seconds to compute the failure links */
+	double simd; /* seconds to build the SIMD prefilter */
+	unsigned int levels; /* number of levels of the tree */
+	int threads; /* number of threads used */
+};
+
+/* Finalize aho-corasick index using <nb_threads> threads, or one thread per
+ * CPU if <nb_threads> is 0. The failure links of each level of the tree are
+ * computed in parallel. If <stats> is not NULL, it receives the time spent
+ * by each phase. Never insert words after calling this function. Small trees
+ * (up to 64 words) get a SIMD prefilter if the CPU supports it.
+ */
+int ac_finalize_threads(struct ac_root *root, int nb_threads, struct ac_finalize_stats *stats);
+
+/* Finalize aho-corasick index with one thread */
+static inline int ac_finalize(struct ac_root *root)
+{
+	return ac_finalize_threads(root, 1, NULL);
+}
+
+/* Merge <nb> finalized trees in <dst>, which is initialized and finalized
+ * by this function. The words of the tree <src[i]> are tagged with the
+ * group (1 << i). The source trees are not modified. All the source trees
+ * must have the same AC_REVERSE flag.
+ */
+int ac_merge(struct ac_root *dst, struct ac_root **src, int nb);
+
+/* copies of a finalized tree, one per NUMA node */
+struct ac_replicas {
+	int nb; /* number of NUMA nodes */
+	struct ac_root *roots; /* the copy allocated on each NUMA node */
+	int nb_cpus; /* number of CPUs */
+	int *cpu_nodes; /* NUMA node of each CPU */
+};
+
+/* Copy the finalized tree <root> on each NUMA node of the system. The
+ * copies don't depend on <root>, except for the case sensitive words of
+ * folded trees. The memory placement is a hint, the copies are usable
+ * even if the system doesn't support it.
+ */
+int ac_replicate(struct ac_replicas *replicas, const struct ac_root *root);
+
+/* Return the copy of the NUMA node of the CPU running the calling thread.
+ * Call it once per thread, after pinning the thread on a CPU or a node:
+ * an unpinned thread may migrate later to another socket and keep
+ * browsing a far copy.
+ */
+const struct ac_root *ac_replica(const struct ac_replicas *replicas);
+
+/* Release the copies */
+void ac_replicas_free(struct ac_replicas *replicas);
+
+/* Write the finalized tree as C code declaring the static const tree
+ * <name>. The code is included in a C file and the search functions
+ * use the tree without init or finalize. The SIMD prefilter is not
+ * written.
+ */
+int ac_write_c(struct ac_root *root, FILE *out, const char *name);
+
+/* Init search engine with multiple result and length. Only the words of
+ * the groups in <mask> are returned, the groups of the word are available
+ * in ac->groups. Trees not built with ac_merge() have only the group 1.
+ * Not available for AC_REVERSE trees.
+ */
+struct ac_result ac_search_firstl_groups(struct ac_search *ac, const struct ac_root *root,
+                                         char *text, size_t length, unsigned int mask);
 
 /* Init search engine with multiple result and length */
-struct ac_result ac_search_firstl(struct ac_search *ac, struct ac_root *root, char *text, size_t length);
+static inline
+struct ac_result ac_search_firstl(struct ac_search *ac, const struct ac_root *root, char *text, size_t length) {
+	return ac_search_firstl_groups(ac, root, text, length, ~0U);
+}
 
 /* Init search engine with multiple result and no length */
 static inline
-struct ac_result ac_search_first(struct ac_search *ac, struct ac_root *root, char *text) {
+struct ac_result ac_search_first(struct ac_search *ac, const struct ac_root *root, char *text) {
 	return ac_search_firstl(ac, root, text, strlen(text));
 }
 
 /* Search next words */
 struct ac_result ac_search_next(struct ac_search *ac);
 
+/* Return the match identifier of the last result, starting from 1. The
+ * words ending on the same node, like case variants of a folded tree,
+ * have the same identifier. Valid for forward and backward searches.
+ */
+unsigned int ac_search_id(const struct ac_search *ac);
+
 /* Simple search which return only first word, or NULL if none match. Wants word length */
-struct ac_result ac_searchl(struct ac_root *root, char *text, size_t length);
+struct ac_result ac_searchl(const struct ac_root *root, char *text, size_t length);
 
 /* Simple search which return only first word, or NULL if none match. do not want word length */
 static inline
-struct ac_result ac_search(struct ac_root *root, char *text)
+struct ac_result ac_search(const struct ac_root *root, char *text)
 {
 	return ac_searchl(root, text, strlen(text));
 }
 
+/* Init backward search engine with multiple result, length and groups.
+ * The text is browsed from its end, the results are ordered by
+ * decreasing start position. Requires AC_REVERSE tree.
+ */
+struct ac_result ac_search_lastl_groups(struct ac_search *ac, const struct ac_root *root,
+                                        char *text, size_t length, unsigned int mask);
+
+/* Init backward search engine with multiple result and length */
+static inline
+struct ac_result ac_search_lastl(struct ac_search *ac, const struct ac_root *root, char *text, size_t length) {
+	return ac_search_lastl_groups(ac, root, text, length, ~0U);
+}
+
+/* Init backward search engine with multiple result and no length */
+static inline
+struct ac_result ac_search_last(struct ac_search *ac, const struct ac_root *root, char *text) {
+	return ac_search_lastl(ac, root, text, strlen(text));
+}
+
+/* Search previous words */
+struct ac_result ac_search_prev(struct ac_search *ac);
+
+/* Count the matches in the text, using <nb_threads> threads, or one thread
+ * per CPU if <nb_threads> is 0. The number of matches of each match
+ * identifier is added to <counts[id - 1]>, which contains root->nb_match
+ * counters. If <counts> is NULL, only the total is computed. Return the
+ * total number of matches. Not available for AC_REVERSE trees.
+ */
+size_t ac_countl_threads(const struct ac_root *root, char *text, size_t length,
+                         unsigned long *counts, int nb_threads);
+
+/* Count the matches in the text with length, using one thread */
+static inline
+size_t ac_countl(const struct ac_root *root, char *text, size_t length, unsigned long *counts)
+{
+	return ac_countl_threads(root, text, length, counts, 1);
+}
+
+/* Count the matches in the text without length, using one thread */
+static inline
+size_t ac_count(const struct ac_root *root, char *text, unsigned long *counts)
+{
+	return ac_countl(root, text, strlen(text), counts);
+}
+
+/* Suffix search which return the shortest word ending the text, or NULL if
+ * none match. At most the length of the longest word is browsed. Requires
+ * AC_REVERSE tree. Wants word length.
+ */
+struct ac_result ac_search_suffixl(const struct ac_root *root, char *text, size_t length);
+
+/* Suffix search, do not want word length */
+static inline
+struct ac_result ac_search_suffix(const struct ac_root *root, char *text)
+{
+	return ac_search_suffixl(root, text, strlen(text));
+}
+
 #endif
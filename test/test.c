@@ -2,6 +2,7 @@
 
 #include <sys/time.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +11,9 @@
 
 #include "aho-corasick.h"
 
+/* static tree generated from the reference data file */
+#include "data.h"
+
 #define EXPECTED_NB_MATCH 2804
 
 void dot_tree(FILE *dotfh, struct ac_node *n, char ch, struct ac_node *root) {
@@ -43,6 +47,8 @@ static inline size_t csz(struct ac_node *n) {
 	int i;
 
 	sz = sizeof(struct ac_node) + (n->last - n->first + 1) * sizeof(struct ac_node *);
+	if (n->match > 0)
+		sz += sizeof(unsigned int); /* match identifier */
 	for (i = n->first; i <= n->last; i++) {
 		if (n->children[i - n->first] != NULL) {
 			sz += csz(n->children[i - n->first]);
@@ -51,6 +57,334 @@ static inline size_t csz(struct ac_node *n) {
 	return sz;
 }
 
+/* Compare results of two trees on the same text, the tree <b> is
+ * searched only for the groups <mask>. Return the number of results,
+ * or -1 if they differ.
+ */
+static int compare_search(const struct ac_root *a, const struct ac_root *b, unsigned int mask,
+                          char *text, size_t length)
+{
+	struct ac_search aca;
+	struct ac_search acb;
+	struct ac_result ra;
+	struct ac_result rb;
+	int nb = 0;
+
+	ra = ac_search_firstl(&aca, a, text, length);
+	rb = ac_search_firstl_groups(&acb, b, text, length, mask);
+	while (1) {
+		if (ra.word != rb.word || ra.length != rb.length)
+			return -1;
+		if (ra.word == NULL)
+			return nb;
+		nb++;
+		ra = ac_search_next(&aca);
+		rb = ac_search_next(&acb);
+	}
+}
+
+/* Load the <nw> first words of <filename> in a tree using SIMD prefilter and
+ * in a tree without, and check the both trees return the same results for
+ * each line and for the whole file.
+ */
+static int simd_check(char *filename, int nw, int flags)
+{
+	struct ac_root a;
+	struct ac_root b;
+	FILE *file;
+	char buffer[1024];
+	char *text = NULL;
+	size_t text_len = 0;
+	size_t len;
+	int line;
+	int nb;
+
+	if (!ac_init_root_flags(&a, flags | AC_NOSIMD) || !ac_init_root_flags(&b, flags)) {
+		fprintf(stderr, "out of memory error\n");
+		return -1;
+	}
+
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Can't open input data file '%s': %s\n", filename, strerror(errno));
+		return -1;
+	}
+	for (line = 0; line < nw && fgets(buffer, 1024, file); line++) {
+		len = strlen(buffer);
+		if (len > 0 && buffer[len-1] == '\n') {
+			buffer[len-1] = '\0';
+		}
+		ac_insert_word_flags(&a, buffer, (flags & AC_FOLD) && (line & 1) ? AC_NOCASE : 0);
+		ac_insert_word_flags(&b, buffer, (flags & AC_FOLD) && (line & 1) ? AC_NOCASE : 0);
+	}
+	ac_finalize(&a);
+	ac_finalize(&b);
+
+	/* check each line, and keep the whole file */
+	rewind(file);
+	while (fgets(buffer, 1024, file)) {
+		len = strlen(buffer);
+		text = realloc(text, text_len + len);
+		if (text == NULL) {
+			fprintf(stderr, "out of memory error\n");
+			return -1;
+		}
+		memcpy(text + text_len, buffer, len);
+		text_len += len;
+		if (len > 0 && buffer[len-1] == '\n') {
+			buffer[len-1] = '\0';
+		}
+		if (compare_search(&a, &b, ~0U, buffer, strlen(buffer)) < 0) {
+			fprintf(stderr, "SIMD lookup differs for <%s>\n", buffer);
+			return -1;
+		}
+	}
+	fclose(file);
+
+	nb = compare_search(&a, &b, ~0U, text, text_len);
+	if (nb < 0) {
+		fprintf(stderr, "SIMD lookup differs for whole file\n");
+		return -1;
+	}
+	free(text);
+	printf("%s: %d words, %d matchs in whole file, prefilter %s\n",
+	       flags & AC_FOLD ? "folded" : "plain", nw, nb, b.teddy != NULL ? "used" : "not used");
+	return 0;
+}
+
+/* Load the <nw> first words of <filename> in a folded tree, odd words are
+ * case insensitive, so the tree uses match descriptors and the SIMD
+ * prefilter when available. Copy the tree on each NUMA node and check the
+ * copy returns the same results for each line and for the whole file.
+ */
+static int replica_check(char *filename, int nw)
+{
+	struct ac_root root;
+	struct ac_replicas replicas;
+	FILE *file;
+	char buffer[1024];
+	char *text = NULL;
+	size_t text_len = 0;
+	size_t len;
+	int line;
+	int nb;
+
+	if (!ac_init_root_flags(&root, AC_FOLD)) {
+		fprintf(stderr, "out of memory error\n");
+		return -1;
+	}
+
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Can't open input data file '%s': %s\n", filename, strerror(errno));
+		return -1;
+	}
+	for (line = 0; line < nw && fgets(buffer, 1024, file); line++) {
+		len = strlen(buffer);
+		if (len > 0 && buffer[len-1] == '\n') {
+			buffer[len-1] = '\0';
+		}
+		ac_insert_word_flags(&root, buffer, line & 1 ? AC_NOCASE : 0);
+	}
+	ac_finalize(&root);
+	if (ac_replicate(&replicas, &root) != 0) {
+		fprintf(stderr, "out of memory error\n");
+		return -1;
+	}
+
+	/* check each line, and keep the whole file */
+	rewind(file);
+	while (fgets(buffer, 1024, file)) {
+		len = strlen(buffer);
+		text = realloc(text, text_len + len);
+		if (text == NULL) {
+			fprintf(stderr, "out of memory error\n");
+			return -1;
+		}
+		memcpy(text + text_len, buffer, len);
+		text_len += len;
+		if (len > 0 && buffer[len-1] == '\n') {
+			buffer[len-1] = '\0';
+		}
+		if (compare_search(&root, ac_replica(&replicas), ~0U, buffer, strlen(buffer)) < 0) {
+			fprintf(stderr, "Folded tree copy lookup differs for <%s>\n", buffer);
+			return -1;
+		}
+	}
+	fclose(file);
+
+	nb = compare_search(&root, ac_replica(&replicas), ~0U, text, text_len);
+	if (nb < 0) {
+		fprintf(stderr, "Folded tree copy lookup differs for whole file\n");
+		return -1;
+	}
+	free(text);
+	ac_replicas_free(&replicas);
+	printf("numa: folded copy, %d words, %d matchs in whole file, prefilter %s\n",
+	       nw, nb, root.teddy != NULL ? "used" : "not used");
+	return 0;
+}
+
+/* Spread the lines of <filename> in <ng> trees, odd trees are folded and
+ * contains case insensitive words. Merge the trees and check the merged
+ * tree returns the same results than each tree when only its group is
+ * enabled, for each line and for each upper case line. Return the number
+ * of matches with all groups enabled, or -1 on error.
+ */
+static int merge_check(char *filename, int ng)
+{
+	struct ac_root src[AC_MAX_GROUPS];
+	struct ac_root *psrc[AC_MAX_GROUPS];
+	struct ac_root merged;
+	struct ac_search ac;
+	struct ac_result res;
+	FILE *file;
+	char buffer[1024];
+	size_t len;
+	int line;
+	int nb;
+	int g;
+
+	if (ng < 1 || ng > AC_MAX_GROUPS) {
+		fprintf(stderr, "Number of groups must be between 1 and %d\n", AC_MAX_GROUPS);
+		return -1;
+	}
+	for (g = 0; g < ng; g++) {
+		if (!ac_init_root_flags(&src[g], g & 1 ? AC_FOLD : 0)) {
+			fprintf(stderr, "out of memory error\n");
+			return -1;
+		}
+		psrc[g] = &src[g];
+	}
+
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Can't open input data file '%s': %s\n", filename, strerror(errno));
+		return -1;
+	}
+	for (line = 0; fgets(buffer, 1024, file); line++) {
+		len = strlen(buffer);
+		if (len > 0 && buffer[len-1] == '\n') {
+			buffer[len-1] = '\0';
+		}
+		g = line % ng;
+		ac_insert_word_flags(&src[g], buffer, (g & 1) && ((line / ng) & 1) ? AC_NOCASE : 0);
+	}
+	for (g = 0; g < ng; g++) {
+		ac_finalize(&src[g]);
+	}
+	if (ac_merge(&merged, psrc, ng) != 0) {
+		fprintf(stderr, "merge error\n");
+		return -1;
+	}
+
+	nb = 0;
+	rewind(file);
+	while (fgets(buffer, 1024, file)) {
+		len = strlen(buffer);
+		if (len > 0 && buffer[len-1] == '\n') {
+			buffer[len-1] = '\0';
+		}
+		for (res = ac_search_first(&ac, &merged, buffer); res.word != NULL; res = ac_search_next(&ac)) {
+			nb++;
+		}
+		for (g = 0; g < ng; g++) {
+			if (compare_search(&src[g], &merged, 1U << g, buffer, strlen(buffer)) < 0) {
+				fprintf(stderr, "Group %d lookup differs for <%s>\n", g, buffer);
+				return -1;
+			}
+		}
+		for (len = 0; buffer[len] != '\0'; len++) {
+			buffer[len] = toupper((unsigned char)buffer[len]);
+		}
+		for (g = 0; g < ng; g++) {
+			if (compare_search(&src[g], &merged, 1U << g, buffer, strlen(buffer)) < 0) {
+				fprintf(stderr, "Group %d lookup differs for <%s>\n", g, buffer);
+				return -1;
+			}
+		}
+	}
+	fclose(file);
+	return nb;
+}
+
+/* Load <filename> words in a tree, and check the counters of the whole file
+ * computed with one and with <nt> threads are the same than the counters
+ * computed from the search results. Return the total, or -1 on error.
+ */
+static int count_check(char *filename, int nt)
+{
+	struct ac_root root;
+	struct ac_search ac;
+	struct ac_result res;
+	FILE *file;
+	char buffer[1024];
+	char *text = NULL;
+	size_t text_len = 0;
+	size_t len;
+	size_t total;
+	unsigned long *expected;
+	unsigned long *counts;
+	int threads[2] = { 1, nt };
+	int i;
+
+	if (!ac_init_root(&root)) {
+		fprintf(stderr, "out of memory error\n");
+		return -1;
+	}
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Can't open input data file '%s': %s\n", filename, strerror(errno));
+		return -1;
+	}
+	while (fgets(buffer, 1024, file)) {
+		len = strlen(buffer);
+		text = realloc(text, text_len + len);
+		if (text == NULL) {
+			fprintf(stderr, "out of memory error\n");
+			return -1;
+		}
+		memcpy(text + text_len, buffer, len);
+		text_len += len;
+		if (len > 0 && buffer[len-1] == '\n') {
+			buffer[len-1] = '\0';
+		}
+		ac_insert_word(&root, buffer);
+	}
+	fclose(file);
+	ac_finalize(&root);
+
+	expected = calloc(root.nb_match, sizeof(unsigned long));
+	counts = calloc(root.nb_match, sizeof(unsigned long));
+	if (expected == NULL || counts == NULL) {
+		fprintf(stderr, "out of memory error\n");
+		return -1;
+	}
+	total = 0;
+	for (res = ac_search_firstl(&ac, &root, text, text_len); res.word != NULL; res = ac_search_next(&ac)) {
+		expected[ac_search_id(&ac) - 1]++;
+		total++;
+	}
+
+	for (i = 0; i < 2; i++) {
+		memset(counts, 0, root.nb_match * sizeof(unsigned long));
+		if (ac_countl_threads(&root, text, text_len, counts, threads[i]) != total ||
+		    memcmp(counts, expected, root.nb_match * sizeof(unsigned long)) != 0) {
+			fprintf(stderr, "Counters differ with %d threads\n", threads[i]);
+			return -1;
+		}
+		if (ac_countl_threads(&root, text, text_len, NULL, threads[i]) != total) {
+			fprintf(stderr, "Total differs with %d threads\n", threads[i]);
+			return -1;
+		}
+	}
+
+	free(expected);
+	free(counts);
+	free(text);
+	return total;
+}
+
 void usage(char *name) {
 	printf("usage: %s <command>\n", name);
 	printf("\n");
@@ -66,6 +400,38 @@ void usage(char *name) {
 	printf("                       is the expected number of match (%d for the\n", EXPECTED_NB_MATCH);
 	printf("                       reference data file\n");
 	printf("\n");
+	printf(" - icheck <data> [<nm>] Same as check, but use case folded tree. Even lines\n");
+	printf("                       are inserted case sensitive, odd lines case insensitive.\n");
+	printf("                       Check also lookup of upper case words.\n");
+	printf("\n");
+	printf(" - rcheck <data> [<nm>] Same as check, but use reversed tree and backward\n");
+	printf("                       search. Check also suffix search.\n");
+	printf("\n");
+	printf(" - mtcheck <data> <nt> [<nm>]\n");
+	printf("                       Same as check, but finalize the tree with <nt> threads\n");
+	printf("                       and display the time spent by each phase.\n");
+	printf("\n");
+	printf(" - count <data> <nt> [<nm>]\n");
+	printf("                       Count <data> words in the whole <data> file with one\n");
+	printf("                       and <nt> threads and check the counters. <nm> is the\n");
+	printf("                       expected number of match.\n");
+	printf("\n");
+	printf(" - numa <data> [<nm>]   Same as check, but use the copy of the tree on the\n");
+	printf("                       NUMA node of the process. Check also the copy of the\n");
+	printf("                       folded trees of the 56 to 64 first words.\n");
+	printf("\n");
+	printf(" - static <data> [<nm>] Same as check, but use the static tree generated at\n");
+	printf("                       build time from the reference data file.\n");
+	printf("\n");
+	printf(" - merge <data> <ng> [<nm>]\n");
+	printf("                       Spread <data> words in <ng> trees, merge them and check\n");
+	printf("                       each group lookup. <nm> is the expected number of match\n");
+	printf("                       with all groups.\n");
+	printf("\n");
+	printf(" - simd <data> [<nw>]  Load <nw> first words of <data> (default 20) and check\n");
+	printf("                       SIMD prefilter lookups return same results than the\n");
+	printf("                       automaton alone.\n");
+	printf("\n");
 	//      12345678901234567890123456789012345678901234567890123456789012345678901234567890
 	printf(" - lk <data> [<txt>]   Search <data> words in <txt>. Text are default for\n");
 	printf("                       provided data file.\n");
@@ -93,6 +459,16 @@ int main(int argc, char *argv[]) {
 	int nb_matchs;
 	int do_sz = 0;
 	int do_check = 0;
+	int do_icheck = 0;
+	int do_rcheck = 0;
+	int do_static = 0;
+	int do_numa = 0;
+	struct ac_replicas replicas;
+	int nb_threads = 1;
+	struct ac_finalize_stats stats;
+	const struct ac_root *tree;
+	int line;
+	char upper[1024];
 	int do_lookup = 0;
 	int do_bench = 0;
 	int nmatch = -1;
@@ -137,6 +513,106 @@ int main(int argc, char *argv[]) {
 		if (argc == 4) {
 			nmatch = atoi(argv[3]);
 		}
+	} else if (strcmp(argv[1], "icheck") == 0) {
+		if (argc < 3 || argc > 4) {
+			usage(argv[0]);
+			exit(1);
+		}
+		do_check = 1;
+		do_icheck = 1;
+		filename = argv[2];
+		if (argc == 4) {
+			nmatch = atoi(argv[3]);
+		}
+	} else if (strcmp(argv[1], "mtcheck") == 0) {
+		if (argc < 4 || argc > 5) {
+			usage(argv[0]);
+			exit(1);
+		}
+		do_check = 1;
+		filename = argv[2];
+		nb_threads = atoi(argv[3]);
+		if (argc == 5) {
+			nmatch = atoi(argv[4]);
+		}
+	} else if (strcmp(argv[1], "numa") == 0) {
+		if (argc < 3 || argc > 4) {
+			usage(argv[0]);
+			exit(1);
+		}
+		do_check = 1;
+		do_numa = 1;
+		filename = argv[2];
+		if (argc == 4) {
+			nmatch = atoi(argv[3]);
+		}
+	} else if (strcmp(argv[1], "static") == 0) {
+		if (argc < 3 || argc > 4) {
+			usage(argv[0]);
+			exit(1);
+		}
+		do_check = 1;
+		do_static = 1;
+		filename = argv[2];
+		if (argc == 4) {
+			nmatch = atoi(argv[3]);
+		}
+	} else if (strcmp(argv[1], "rcheck") == 0) {
+		if (argc < 3 || argc > 4) {
+			usage(argv[0]);
+			exit(1);
+		}
+		do_check = 1;
+		do_rcheck = 1;
+		filename = argv[2];
+		if (argc == 4) {
+			nmatch = atoi(argv[3]);
+		}
+	} else if (strcmp(argv[1], "count") == 0) {
+		if (argc < 4 || argc > 5) {
+			usage(argv[0]);
+			exit(1);
+		}
+		nb_matchs = count_check(argv[2], atoi(argv[3]));
+		if (nb_matchs < 0) {
+			exit(1);
+		}
+		if (argc == 5 && nb_matchs != atoi(argv[4])) {
+			fprintf(stderr, "Expect %d match, got %d\n", atoi(argv[4]), nb_matchs);
+			exit(1);
+		}
+		printf("ok\n");
+		exit(0);
+	} else if (strcmp(argv[1], "merge") == 0) {
+		if (argc < 4 || argc > 5) {
+			usage(argv[0]);
+			exit(1);
+		}
+		nb_matchs = merge_check(argv[2], atoi(argv[3]));
+		if (nb_matchs < 0) {
+			exit(1);
+		}
+		if (argc == 5 && nb_matchs != atoi(argv[4])) {
+			fprintf(stderr, "Expect %d match, got %d\n", atoi(argv[4]), nb_matchs);
+			exit(1);
+		}
+		printf("ok\n");
+		exit(0);
+	} else if (strcmp(argv[1], "simd") == 0) {
+		if (argc < 3 || argc > 4) {
+			usage(argv[0]);
+			exit(1);
+		}
+		nmatch = 20;
+		if (argc == 4) {
+			nmatch = atoi(argv[3]);
+		}
+		if (simd_check(argv[2], nmatch, 0) != 0 ||
+		    simd_check(argv[2], nmatch, AC_FOLD) != 0) {
+			exit(1);
+		}
+		printf("ok\n");
+		exit(0);
 	} else if (strcmp(argv[1], "lk") == 0) {
 		if (argc < 3 || argc > 4) {
 			usage(argv[0]);
@@ -166,7 +642,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	/* create tree root */
-	if (!ac_init_root(&root)) {
+	if (!ac_init_root_flags(&root, (do_icheck ? AC_FOLD : 0) | (do_rcheck ? AC_REVERSE : 0))) {
 		fprintf(stderr, "out of memory error\n");
 		exit(1);
 	}
@@ -177,17 +653,43 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "Can't open input data file '%s': %s\n", filename, strerror(errno));
 		exit(1);
 	}
+	line = 0;
 	while (fgets(buffer, 1024, file)) {
 		len = strlen(buffer);
 		if (len > 0 && buffer[len-1] == '\n') {
 			buffer[len-1] = '\0';
 		}
-		ac_insert_word(&root, buffer);
+		ac_insert_word_flags(&root, buffer, do_icheck && (line & 1) ? AC_NOCASE : 0);
+		line++;
 	}
 	fclose(file);
 
 	/* finalize aho-corasick tree - compute backlinks */
-	ac_finalize(&root);
+	if (ac_finalize_threads(&root, nb_threads, &stats) != 0) {
+		fprintf(stderr, "out of memory error\n");
+		exit(1);
+	}
+	if (nb_threads != 1) {
+		printf("finalize: %d threads, %u levels, copy %.6fs, fail links %.6fs, simd %.6fs\n",
+		       stats.threads, stats.levels, stats.copy, stats.fail, stats.simd);
+	}
+
+	/* Copy the tree on each NUMA node */
+	if (do_numa) {
+		if (ac_replicate(&replicas, &root) != 0) {
+			fprintf(stderr, "out of memory error\n");
+			exit(1);
+		}
+		printf("numa: %d copies\n", replicas.nb);
+		/* the number of words changes the alignment of the parts
+		 * following the nodes in the copy.
+		 */
+		for (line = 56; line <= 64; line++) {
+			if (replica_check(filename, line) != 0) {
+				exit(1);
+			}
+		}
+	}
 
 	/* Display size used by the tree */
 	if (do_sz) {
@@ -207,6 +709,14 @@ int main(int argc, char *argv[]) {
 	/* check lookup of all words in the input list */
 	if (do_check) {
 		nb_matchs = 0;
+		if (do_static) {
+			tree = &ac_data;
+		} else if (do_numa) {
+			tree = ac_replica(&replicas);
+		} else {
+			tree = &root;
+		}
+		line = 0;
 		file = fopen(filename, "r");
 		if (file == NULL) {
 			fprintf(stderr, "Can't open input data file '%s': %s\n", filename, strerror(errno));
@@ -218,7 +728,12 @@ int main(int argc, char *argv[]) {
 				buffer[len-1] = '\0';
 			}
 			ok = 0;
-			for (res = ac_search_first(&ac, &root, buffer); res.word != NULL; res = ac_search_next(&ac)) {
+			if (do_rcheck) {
+				res = ac_search_last(&ac, tree, buffer);
+			} else {
+				res = ac_search_first(&ac, tree, buffer);
+			}
+			for (; res.word != NULL; res = do_rcheck ? ac_search_prev(&ac) : ac_search_next(&ac)) {
 				nb_matchs++;
 				if (strlen(buffer) == res.length && strncmp(res.word, buffer, res.length) == 0) {
 					ok = 1;
@@ -228,6 +743,53 @@ int main(int argc, char *argv[]) {
 				fprintf(stderr, "Word <%s> not found\n", buffer);
 				exit(1);
 			}
+
+			/* static tree and copies must return exactly the results of the loaded tree */
+			if ((do_static || do_numa) && compare_search(&root, tree, ~0U, buffer, strlen(buffer)) < 0) {
+				fprintf(stderr, "Tree copy lookup differs for <%s>\n", buffer);
+				exit(1);
+			}
+
+			/* The word itself ends the text, so the suffix search
+			 * must return a word ending the text.
+			 */
+			if (do_rcheck) {
+				res = ac_search_suffix(&root, buffer);
+				if (res.word == NULL || res.word + res.length != buffer + strlen(buffer)) {
+					fprintf(stderr, "Suffix of <%s> not found\n", buffer);
+					exit(1);
+				}
+			}
+
+			/* trees are browsed only in the direction of their words */
+			if (do_rcheck)
+				res = ac_search_first(&ac, &root, buffer);
+			else
+				res = ac_search_last(&ac, &root, buffer);
+			if (res.word != NULL) {
+				fprintf(stderr, "Search of <%s> in the wrong direction not rejected\n", buffer);
+				exit(1);
+			}
+
+			/* upper case word must match only if it is case insensitive
+			 * or if the case sensitive word is not changed by upper case.
+			 */
+			if (do_icheck) {
+				for (len = 0; buffer[len] != '\0'; len++)
+					upper[len] = toupper((unsigned char)buffer[len]);
+				upper[len] = '\0';
+				ok = 0;
+				for (res = ac_search_first(&ac, &root, upper); res.word != NULL; res = ac_search_next(&ac)) {
+					if (strlen(upper) == res.length) {
+						ok = 1;
+					}
+				}
+				if (ok != ((line & 1) || strcmp(upper, buffer) == 0)) {
+					fprintf(stderr, "Upper case word <%s> %s\n", upper, ok ? "unexpected match" : "not found");
+					exit(1);
+				}
+			}
+			line++;
 		}
 		fclose(file);
 		if (nmatch != -1 && nb_matchs != nmatch) {
@@ -0,0 +1,100 @@
+/* Copyright (c) 2023 Thierry FOURNIER (tfournier@arpalert.org) */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aho-corasick.h"
+
+void usage(char *name) {
+	printf("usage: %s [-i] [-r] <name> <words> [<out>]\n", name);
+	printf("\n");
+	printf("Build the tree of the <words> file, one word per line, and write it as\n");
+	printf("C code declaring the static const tree <name>. Include the generated\n");
+	printf("file and use the tree with the search functions, without init. <out>\n");
+	printf("is the generated file, default is stdout.\n");
+	printf("\n");
+	printf(" -i  words are case insensitive\n");
+	printf(" -r  reversed tree, for backward and suffix search\n");
+}
+
+int main(int argc, char *argv[]) {
+	struct ac_root root;
+	FILE *file;
+	FILE *out;
+	char *buffer = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int flags = 0;
+	int word_flags = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ir")) != -1) {
+		switch (opt) {
+		case 'i':
+			flags |= AC_FOLD;
+			word_flags |= AC_NOCASE;
+			break;
+		case 'r':
+			flags |= AC_REVERSE;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (argc - optind < 2 || argc - optind > 3) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (!ac_init_root_flags(&root, flags)) {
+		fprintf(stderr, "out of memory error\n");
+		exit(1);
+	}
+
+	/* load words */
+	file = fopen(argv[optind + 1], "r");
+	if (file == NULL) {
+		fprintf(stderr, "Can't open input words file '%s': %s\n", argv[optind + 1], strerror(errno));
+		exit(1);
+	}
+	while ((len = getline(&buffer, &size, file)) != -1) {
+		if (len > 0 && buffer[len-1] == '\n') {
+			len--;
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (ac_insert_wordl_flags(&root, buffer, len, word_flags) != 0) {
+			fprintf(stderr, "out of memory error\n");
+			exit(1);
+		}
+	}
+	free(buffer);
+	fclose(file);
+
+	if (ac_finalize(&root) != 0) {
+		fprintf(stderr, "out of memory error\n");
+		exit(1);
+	}
+
+	/* write tree */
+	if (argc - optind == 3) {
+		out = fopen(argv[optind + 2], "w");
+		if (out == NULL) {
+			fprintf(stderr, "Can't open output file '%s': %s\n", argv[optind + 2], strerror(errno));
+			exit(1);
+		}
+	} else {
+		out = stdout;
+	}
+	if (ac_write_c(&root, out, argv[optind]) != 0 || fclose(out) != 0) {
+		fprintf(stderr, "Can't write tree: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	exit(0);
+}
@@ -0,0 +1,553 @@
+/* Copyright (c) 2023 Thierry FOURNIER (tfournier@arpalert.org) */
+
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np() */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aho-corasick.h"
+
+/* default size of each read buffer for pipes and terminals */
+#define SCAN_BUFSZ (4 * 1024 * 1024)
+
+/* size of the output buffer of each thread */
+#define OUT_BUFSZ (64 * 1024)
+
+/* output buffer, written only with complete records, so the
+ * records of concurrent threads never mix.
+ */
+struct out {
+	size_t len;
+	char buf[OUT_BUFSZ];
+};
+
+/* scanning context shared by all the threads */
+struct scan {
+	struct ac_root root;
+	struct ac_replicas replicas;
+	int use_replicas;
+	unsigned int *patterns; /* pattern number of each match identifier */
+	char **files;
+	int nb_files;
+	int next_file; /* next file to scan, protected by lock */
+	int nb_threads;
+	int count; /* display only the number of matches of each file */
+	size_t bufsz;
+	int matched; /* at least one match found, protected by lock */
+	int error; /* at least one file error, protected by lock */
+	pthread_mutex_t lock;
+};
+
+/* double buffered reads of a stream. The reader thread fills one buffer
+ * while the other one is scanned. Each buffer starts with <back> free
+ * bytes, where the scanner copies the end of the previous buffer.
+ */
+struct stream {
+	int fd;
+	size_t size; /* max bytes read in each buffer */
+	size_t back; /* free bytes before the read bytes */
+	char *buf[2];
+	ssize_t len[2]; /* bytes read, 0 for end of file, -1 for error */
+	int filled[2];
+	int err; /* errno of the read error */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void usage(char *name) {
+	printf("usage: %s [-i] [-c] [-j <nt>] [-b <size>] {-e <word> | -f <words>}... [<file>...]\n", name);
+	printf("\n");
+	printf("Search all the words in the files, or in the standard input if no file is\n");
+	printf("given or if the file is '-'. Each match is displayed as\n");
+	printf("<file>:<offset>:<pattern>, where <offset> is the byte offset of the match\n");
+	printf("in the file and <pattern> is the number of the word, starting from 1 in\n");
+	printf("the order of the -e and -f options.\n");
+	printf("\n");
+	printf(" -e <word>   search <word>\n");
+	printf(" -f <words>  search each line of the file <words>\n");
+	printf(" -i          words are case insensitive\n");
+	printf(" -c          display only the number of matches of each file\n");
+	printf(" -j <nt>     scan files with <nt> threads, 0 is one thread per CPU\n");
+	printf(" -b <size>   size of the read buffers for pipes (default %d)\n", SCAN_BUFSZ);
+	printf("\n");
+	printf("Regular files are mapped in memory, other files are read in two buffers\n");
+	printf("to overlap the reads and the search. Exit status is 0 if at least one word\n");
+	printf("matches, 1 if none matches and 2 on error.\n");
+}
+
+static void out_flush(struct out *o)
+{
+	fwrite(o->buf, 1, o->len, stdout);
+	o->len = 0;
+}
+
+static void out_record(struct out *o, const char *name, unsigned long long offset, unsigned int pattern)
+{
+	int len;
+
+	len = snprintf(o->buf + o->len, OUT_BUFSZ - o->len, "%s:%llu:%u\n", name, offset, pattern);
+	if (len >= OUT_BUFSZ - o->len) {
+		out_flush(o);
+		len = snprintf(o->buf, OUT_BUFSZ, "%s:%llu:%u\n", name, offset, pattern);
+		if (len >= OUT_BUFSZ) {
+			printf("%s:%llu:%u\n", name, offset, pattern);
+			return;
+		}
+	}
+	o->len += len;
+}
+
+static void out_count(struct out *o, const char *name, size_t count)
+{
+	out_flush(o);
+	printf("%s:%zu\n", name, count);
+}
+
+/* Search <text> and display the matches ending after the <from> first
+ * bytes. <offset> is the offset of <text> in the file. Return the number
+ * of matches.
+ */
+static size_t scan_text(struct scan *scan, const struct ac_root *tree, struct out *o, const char *name,
+                        char *text, size_t length, size_t from, unsigned long long offset)
+{
+	struct ac_search ac;
+	struct ac_result res;
+	size_t nb = 0;
+
+	if (scan->count) {
+		nb = ac_countl(tree, text, length, NULL);
+		if (from > 0)
+			nb -= ac_countl(tree, text, from, NULL);
+		return nb;
+	}
+
+	for (res = ac_search_firstl(&ac, tree, text, length); res.word != NULL; res = ac_search_next(&ac)) {
+		if (res.word + res.length - text <= from)
+			continue;
+		out_record(o, name, offset + (res.word - text), scan->patterns[ac_search_id(&ac) - 1]);
+		nb++;
+	}
+	return nb;
+}
+
+/* Fill each buffer up to <size> bytes. A pipe returns at most its own
+ * size on each read, so many reads are needed for one buffer.
+ */
+static void *stream_read(void *arg)
+{
+	struct stream *s = arg;
+	ssize_t len;
+	ssize_t n;
+	int eof = 0;
+	int err = 0;
+	int k;
+
+	for (k = 0; ; k ^= 1) {
+		pthread_mutex_lock(&s->lock);
+		while (s->filled[k])
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+
+		len = 0;
+		while (!eof && (size_t)len < s->size) {
+			n = read(s->fd, s->buf[k] + s->back + len, s->size - len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				err = errno;
+				len = -1;
+				break;
+			}
+			if (n == 0)
+				eof = 1;
+			len += n;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->err = err;
+		s->len[k] = len;
+		s->filled[k] = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		if (len <= 0)
+			break;
+	}
+	return NULL;
+}
+
+/* Scan a stream. The <back> last bytes of each buffer are copied before
+ * the next one, so the words crossing two buffers are found, and only the
+ * matches ending in the new bytes are reported. Return the number of
+ * matches, or -1 on error.
+ */
+static long long scan_stream(struct scan *scan, const struct ac_root *tree, struct out *o,
+                             const char *name, int fd)
+{
+	struct stream s;
+	pthread_t reader;
+	unsigned long long pos = 0;
+	long long nb = 0;
+	char *tail;
+	char *region;
+	size_t carry = 0;
+	ssize_t len;
+	int k;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+	s.size = scan->bufsz;
+	s.back = tree->longest > 0 ? tree->longest - 1 : 0;
+	s.buf[0] = malloc(s.back + s.size);
+	s.buf[1] = malloc(s.back + s.size);
+	tail = malloc(s.back + 1);
+	if (s.buf[0] == NULL || s.buf[1] == NULL || tail == NULL) {
+		fprintf(stderr, "out of memory error\n");
+		free(s.buf[0]);
+		free(s.buf[1]);
+		free(tail);
+		return -1;
+	}
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+	if (pthread_create(&reader, NULL, stream_read, &s) != 0) {
+		fprintf(stderr, "Can't start reader thread\n");
+		nb = -1;
+		goto out;
+	}
+
+	for (k = 0; ; k ^= 1) {
+		pthread_mutex_lock(&s.lock);
+		while (!s.filled[k])
+			pthread_cond_wait(&s.cond, &s.lock);
+		len = s.len[k];
+		pthread_mutex_unlock(&s.lock);
+
+		if (len < 0) {
+			fprintf(stderr, "Can't read '%s': %s\n", name, strerror(s.err));
+			nb = -1;
+			break;
+		}
+		if (len == 0)
+			break;
+
+		/* scan the end of the previous buffer followed by the new bytes */
+		region = s.buf[k] + s.back - carry;
+		memcpy(region, tail, carry);
+		nb += scan_text(scan, tree, o, name, region, carry + len, carry, pos - carry);
+		pos += len;
+		if (carry + len > s.back)
+			carry = s.back;
+		else
+			carry += len;
+		memcpy(tail, s.buf[k] + s.back + len - carry, carry);
+
+		/* give back the buffer to the reader */
+		pthread_mutex_lock(&s.lock);
+		s.filled[k] = 0;
+		pthread_cond_signal(&s.cond);
+		pthread_mutex_unlock(&s.lock);
+	}
+	pthread_join(reader, NULL);
+
+out:
+	pthread_cond_destroy(&s.cond);
+	pthread_mutex_destroy(&s.lock);
+	free(s.buf[0]);
+	free(s.buf[1]);
+	free(tail);
+	return nb;
+}
+
+/* Scan one file, mapped in memory if it is a regular file. Return the
+ * number of matches, or -1 on error.
+ */
+static long long scan_file(struct scan *scan, const struct ac_root *tree, struct out *o, char *filename)
+{
+	struct stat st;
+	const char *name;
+	long long nb;
+	char *text;
+	int fd;
+
+	if (strcmp(filename, "-") == 0) {
+		fd = 0;
+		name = "-";
+	} else {
+		fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Can't open '%s': %s\n", filename, strerror(errno));
+			return -1;
+		}
+		name = filename;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "Can't stat '%s': %s\n", name, strerror(errno));
+		nb = -1;
+	} else if (S_ISREG(st.st_mode) && st.st_size == 0) {
+		nb = 0;
+	} else if (S_ISREG(st.st_mode)) {
+		text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text == MAP_FAILED) {
+			fprintf(stderr, "Can't map '%s': %s\n", name, strerror(errno));
+			nb = -1;
+		} else {
+			madvise(text, st.st_size, MADV_SEQUENTIAL);
+			if (scan->count && scan->nb_files == 1)
+				nb = ac_countl_threads(tree, text, st.st_size, NULL, scan->nb_threads);
+			else
+				nb = scan_text(scan, tree, o, name, text, st.st_size, 0, 0);
+			munmap(text, st.st_size);
+		}
+	} else {
+		nb = scan_stream(scan, tree, o, name, fd);
+	}
+
+	if (nb >= 0 && scan->count)
+		out_count(o, name, nb);
+	if (fd != 0)
+		close(fd);
+	return nb;
+}
+
+/* Scan the files not yet processed by the other threads */
+static void *scan_run(void *arg)
+{
+	struct scan *scan = arg;
+	const struct ac_root *tree;
+	struct out *o;
+	long long nb;
+	int i;
+
+	o = malloc(sizeof(struct out));
+	if (o == NULL) {
+		fprintf(stderr, "out of memory error\n");
+		pthread_mutex_lock(&scan->lock);
+		scan->error = 1;
+		pthread_mutex_unlock(&scan->lock);
+		return NULL;
+	}
+	o->len = 0;
+
+	/* use the copy of the tree local to this thread */
+	tree = scan->use_replicas ? ac_replica(&scan->replicas) : &scan->root;
+
+	while (1) {
+		pthread_mutex_lock(&scan->lock);
+		i = scan->next_file++;
+		pthread_mutex_unlock(&scan->lock);
+		if (i >= scan->nb_files)
+			break;
+
+		nb = scan_file(scan, tree, o, scan->files[i]);
+		out_flush(o);
+
+		pthread_mutex_lock(&scan->lock);
+		if (nb < 0)
+			scan->error = 1;
+		else if (nb > 0)
+			scan->matched = 1;
+		pthread_mutex_unlock(&scan->lock);
+	}
+
+	free(o);
+	return NULL;
+}
+
+/* Set the allowed CPUs of the NUMA <node> in the thread attributes */
+static void scan_pin(pthread_attr_t *attr, const struct ac_replicas *replicas, int node)
+{
+	cpu_set_t allowed;
+	cpu_set_t set;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	CPU_ZERO(&set);
+	for (cpu = 0; cpu < replicas->nb_cpus && cpu < CPU_SETSIZE; cpu++)
+		if (replicas->cpu_nodes[cpu] == node && CPU_ISSET(cpu, &allowed))
+			CPU_SET(cpu, &set);
+	if (CPU_COUNT(&set) > 0)
+		pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/* Insert a word and register its pattern number */
+static int add_word(struct scan *scan, char *word, size_t len, int flags, unsigned int *nb_patterns)
+{
+	unsigned int *patterns;
+	unsigned int nb_match;
+
+	(*nb_patterns)++;
+	if (len == 0)
+		return 0;
+	nb_match = scan->root.nb_match;
+	if (ac_insert_wordl_flags(&scan->root, word, len, flags) != 0)
+		return -1;
+
+	/* new match identifier, the first word of each identifier gives
+	 * the pattern number.
+	 */
+	if (scan->root.nb_match > nb_match) {
+		patterns = realloc(scan->patterns, scan->root.nb_match * sizeof(unsigned int));
+		if (patterns == NULL)
+			return -1;
+		scan->patterns = patterns;
+		scan->patterns[nb_match] = *nb_patterns;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct scan scan;
+	pthread_t *threads;
+	pthread_attr_t attr;
+	FILE *file;
+	char *stdin_file = "-";
+	char *buffer = NULL;
+	size_t size = 0;
+	ssize_t len;
+	unsigned int nb_patterns = 0;
+	int word_flags = 0;
+	int opt;
+	int i;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.nb_threads = 1;
+	scan.bufsz = SCAN_BUFSZ;
+	pthread_mutex_init(&scan.lock, NULL);
+
+	/* case insensitive option must be known before inserting words */
+	while ((opt = getopt(argc, argv, "e:f:icj:b:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			word_flags = AC_NOCASE;
+			break;
+		case 'c':
+			scan.count = 1;
+			break;
+		case 'j':
+			scan.nb_threads = atoi(optarg);
+			break;
+		case 'b':
+			scan.bufsz = strtoul(optarg, NULL, 0);
+			if (scan.bufsz == 0) {
+				usage(argv[0]);
+				exit(2);
+			}
+			break;
+		case 'e':
+		case 'f':
+			break;
+		default:
+			usage(argv[0]);
+			exit(2);
+		}
+	}
+
+	if (!ac_init_root_flags(&scan.root, word_flags ? AC_FOLD : 0)) {
+		fprintf(stderr, "out of memory error\n");
+		exit(2);
+	}
+
+	/* load words in the options order */
+	optind = 1;
+	while ((opt = getopt(argc, argv, "e:f:icj:b:h")) != -1) {
+		if (opt == 'e') {
+			if (add_word(&scan, optarg, strlen(optarg), word_flags, &nb_patterns) != 0) {
+				fprintf(stderr, "out of memory error\n");
+				exit(2);
+			}
+		} else if (opt == 'f') {
+			file = fopen(optarg, "r");
+			if (file == NULL) {
+				fprintf(stderr, "Can't open words file '%s': %s\n", optarg, strerror(errno));
+				exit(2);
+			}
+			while ((len = getline(&buffer, &size, file)) != -1) {
+				if (len > 0 && buffer[len-1] == '\n') {
+					len--;
+				}
+				if (add_word(&scan, buffer, len, word_flags, &nb_patterns) != 0) {
+					fprintf(stderr, "out of memory error\n");
+					exit(2);
+				}
+			}
+			fclose(file);
+		}
+	}
+	free(buffer);
+	if (nb_patterns == 0) {
+		usage(argv[0]);
+		exit(2);
+	}
+
+	if (ac_finalize_threads(&scan.root, 0, NULL) != 0) {
+		fprintf(stderr, "out of memory error\n");
+		exit(2);
+	}
+
+	if (optind < argc) {
+		scan.files = &argv[optind];
+		scan.nb_files = argc - optind;
+	} else {
+		scan.files = &stdin_file;
+		scan.nb_files = 1;
+	}
+
+	if (scan.nb_threads <= 0) {
+		scan.nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (scan.nb_threads <= 0)
+			scan.nb_threads = 1;
+	}
+
+	/* one file thread per file at most, a single file is counted
+	 * with all the threads.
+	 */
+	if (scan.nb_threads == 1 || scan.nb_files == 1) {
+		scan_run(&scan);
+	} else {
+		if (ac_replicate(&scan.replicas, &scan.root) == 0)
+			scan.use_replicas = 1;
+		if (scan.nb_threads > scan.nb_files)
+			scan.nb_threads = scan.nb_files;
+		threads = calloc(scan.nb_threads, sizeof(pthread_t));
+		if (threads == NULL) {
+			fprintf(stderr, "out of memory error\n");
+			exit(2);
+		}
+		for (i = 0; i < scan.nb_threads; i++) {
+			/* the threads are spread on the NUMA nodes and pinned,
+			 * so each one keeps the replica of its node.
+			 */
+			pthread_attr_init(&attr);
+			if (scan.use_replicas && scan.replicas.nb > 1)
+				scan_pin(&attr, &scan.replicas, i % scan.replicas.nb);
+			if (pthread_create(&threads[i], &attr, scan_run, &scan) != 0) {
+				fprintf(stderr, "Can't start thread: %s\n", strerror(errno));
+				exit(2);
+			}
+			pthread_attr_destroy(&attr);
+		}
+		for (i = 0; i < scan.nb_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		free(threads);
+		if (scan.use_replicas)
+			ac_replicas_free(&scan.replicas);
+	}
+
+	fflush(stdout);
+	if (scan.error)
+		exit(2);
+	exit(scan.matched ? 0 : 1);
+}